@@ -0,0 +1,195 @@
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Executable memory for linked programs. Programs are carved out of large
+// mappings instead of getting one each, so a small script costs neither an
+// mmap nor a page of its own, and the code of a program that is unloaded
+// goes back to the pool. Free space is kept by address, so neighbouring
+// free blocks merge and the first block that fits is the lowest one.
+//
+// Mappings are aligned to and sized in 2MB huge pages and backed by
+// transparent huge pages, so a large program takes a few iTLB entries
+// instead of one per 4K page. They are carved out of one reserved range,
+// which keeps all code and the module global tables (see main.cpp) within
+// reach of a 32-bit displacement; only once the range is used up do
+// mappings go elsewhere, trying explicit huge pages first. With
+// --lock-code mappings are also locked and faulted in up front, so the
+// first call into new code does not take a page fault.
+
+const size_t arena_huge_page = 2 << 20;
+const size_t arena_chunk_size = 8 * arena_huge_page;
+const size_t arena_range_size = (size_t)1 << 30;
+const size_t arena_align = 64;
+const size_t arena_page = 4096;
+
+struct CodeArena
+{
+    std::mutex lock;
+    std::vector<std::pair<uint8_t *, size_t>> chunks;
+
+    // Start of every free block and its size.
+    std::map<uint8_t *, size_t> free_blocks;
+    size_t used;
+
+    // Reserved range and how much of it has been mapped.
+    uint8_t *range;
+    size_t range_used;
+
+    bool locked;
+};
+
+CodeArena code_arena;
+
+size_t arena_round(size_t size)
+{
+    return (size + arena_align - 1) & ~(arena_align - 1);
+}
+
+// Aligned to a huge page; size a multiple of one.
+uint8_t *arena_map_aligned(size_t size, int prot)
+{
+    void *mem = mmap(nullptr, size + arena_huge_page, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+
+    uintptr_t start = ((uintptr_t)mem + arena_huge_page - 1) & ~(uintptr_t)(arena_huge_page - 1);
+    size_t head = start - (uintptr_t)mem;
+
+    if (head > 0)
+        munmap(mem, head);
+    munmap((void *)(start + size), arena_huge_page - head);
+
+    return (uint8_t *)start;
+}
+
+uint8_t *arena_map(CodeArena &arena, size_t size)
+{
+    const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+    if (arena.range == nullptr)
+        arena.range = arena_map_aligned(arena_range_size, PROT_NONE);
+
+    void *mem = nullptr;
+    if (arena.range != nullptr && arena.range_used + size <= arena_range_size)
+    {
+        mem = arena.range + arena.range_used;
+        if (mprotect(mem, size, prot) != 0)
+            return nullptr;
+
+        arena.range_used += size;
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+    else
+    {
+        mem = mmap(nullptr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            mem = arena_map_aligned(size, prot);
+            if (mem == nullptr)
+                return nullptr;
+
+            madvise(mem, size, MADV_HUGEPAGE);
+        }
+    }
+
+    if (arena.locked && mlock(mem, size) != 0)
+    {
+        // Without the rlimit for locking, at least fault every page in.
+        for (size_t i = 0; i < size; i += arena_page)
+        {
+            ((volatile uint8_t *)mem)[i] = 0;
+        }
+    }
+
+    return (uint8_t *)mem;
+}
+
+// Code gets 64 byte alignment. Data that code writes to takes whole pages
+// of its own (align and size of arena_page), so no store ever lands on a
+// page that holds code.
+uint8_t *arena_alloc(CodeArena &arena, size_t size, size_t align = arena_align)
+{
+    size = arena_round(std::max(size, (size_t)1));
+
+    std::lock_guard<std::mutex> guard(arena.lock);
+
+    auto aligned = [align](uint8_t *p) {
+        return (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    };
+
+    auto it = arena.free_blocks.begin();
+    while (it != arena.free_blocks.end() && aligned(it->first) + size > it->first + it->second)
+    {
+        ++it;
+    }
+
+    if (it == arena.free_blocks.end())
+    {
+        size_t chunk = std::max((size + arena_huge_page - 1) & ~(arena_huge_page - 1), arena_chunk_size);
+        uint8_t *mem = arena_map(arena, chunk);
+        if (mem == nullptr)
+            return nullptr;
+
+        arena.chunks.push_back({mem, chunk});
+        it = arena.free_blocks.insert({mem, chunk}).first;
+    }
+
+    uint8_t *start = it->first;
+    uint8_t *block = aligned(start);
+    size_t left = it->second - (block - start) - size;
+    arena.free_blocks.erase(it);
+
+    if (block > start)
+        arena.free_blocks.insert({start, (size_t)(block - start)});
+    if (left > 0)
+        arena.free_blocks.insert({block + size, left});
+
+    arena.used += size;
+    mem_count(MEM_CODE, size);
+    mem_charge(size);
+    return block;
+}
+
+// Blocks are only merged with neighbours from the same mapping.
+bool arena_same_chunk(CodeArena &arena, uint8_t *a, uint8_t *b)
+{
+    for (auto it = arena.chunks.begin(); it != arena.chunks.end(); ++it)
+    {
+        if (a >= it->first && a < it->first + it->second)
+            return b >= it->first && b < it->first + it->second;
+    }
+
+    return false;
+}
+
+void arena_free(CodeArena &arena, uint8_t *block, size_t size)
+{
+    size = arena_round(std::max(size, (size_t)1));
+
+    std::lock_guard<std::mutex> guard(arena.lock);
+    arena.used -= size;
+    mem_count(MEM_CODE, -(int64_t)size);
+
+    auto next = arena.free_blocks.lower_bound(block);
+    if (next != arena.free_blocks.end() && next->first == block + size && arena_same_chunk(arena, block, next->first))
+    {
+        size += next->second;
+        next = arena.free_blocks.erase(next);
+    }
+
+    if (next != arena.free_blocks.begin())
+    {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == block && arena_same_chunk(arena, prev->first, block))
+        {
+            prev->second += size;
+            return;
+        }
+    }
+
+    arena.free_blocks.insert({block, size});
+}
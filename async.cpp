@@ -0,0 +1,551 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.cpp"
+
+// Tasks. spawn(fn) makes a task that calls fn with no arguments on a stack
+// of its own, and await(task) gives back what fn returned. A task runs on
+// the thread that spawned it, once that thread waits for something: an
+// await, a file builtin, a parallel builtin, or the end of the program or
+// of a chunk of a parallel body on a pool thread. Tasks switch where they
+// wait, inside a call to a native, so compiled code never sees the switch
+// and needs nothing special to run on a task's stack.
+//
+// Tasks can be awaited from any thread but are only ever resumed by the
+// scheduler of the thread that spawned them; other threads hand them back
+// through its inbox.
+//
+// read_file, write_file and read_lines suspend the task that calls them
+// until the kernel is done (see io.cpp); called outside of a task they run
+// other tasks while they wait. Opening and closing files is done in place.
+
+const size_t task_stack_size = 1 << 20;
+const size_t task_stack_guard = 4096;
+const size_t task_stack_cache = 64;
+
+struct Scheduler;
+
+struct Task : public Obj
+{
+    uint64_t fn;
+    uint64_t result;
+    std::atomic<bool> done;
+    Scheduler *owner;
+
+    // Saved stack pointer while suspended, and the stack until done.
+    void *sp;
+    uint8_t *stack;
+
+    // The task's mem_escape while it is suspended.
+    jmp_buf *escape;
+
+    // Tasks waiting for this one, and schedulers waiting for it on their
+    // thread's own stack; guarded by lock until done.
+    std::mutex lock;
+    std::vector<Task *> waiters;
+    std::vector<Scheduler *> stack_waiters;
+};
+
+Type *task_type;
+
+struct Scheduler
+{
+    std::deque<Task *> ready;
+
+    // Running task, or nullptr on the thread's own stack, whose stack
+    // pointer is kept in thread_sp while a task runs.
+    Task *current;
+    void *thread_sp;
+
+    // Done task whose stack is given back once it has been left.
+    Task *finished;
+    std::vector<uint8_t *> stacks;
+
+    // Tasks of this scheduler woken by other threads, and how many of its
+    // waits (its tasks' and its own stack's) are on tasks of other threads.
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<Task *> inbox;
+    int64_t foreign_waits;
+};
+
+thread_local Scheduler scheduler;
+
+// task_switch(save, load) saves the callee-saved registers and the SSE and
+// x87 control words on the stack, stores the stack pointer in *save and
+// returns on the stack at load. Everything else is saved by the caller.
+extern "C" void task_switch(void **save, void *load);
+
+asm(R"(
+    .text
+    .p2align 4
+    .type task_switch, @function
+task_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size task_switch, .-task_switch
+)");
+
+// Stacks are mapped lazily with a guard page at the bottom, and done tasks
+// give theirs back to a per-thread cache.
+uint8_t *task_stack_acquire(Scheduler &s)
+{
+    if (!s.stacks.empty())
+    {
+        uint8_t *stack = s.stacks.back();
+        s.stacks.pop_back();
+        return stack;
+    }
+
+    void *mem = mmap(nullptr, task_stack_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+
+    mprotect(mem, task_stack_guard, PROT_NONE);
+    return (uint8_t *)mem;
+}
+
+void task_stack_release(Scheduler &s, uint8_t *stack)
+{
+    if (s.stacks.size() < task_stack_cache)
+        s.stacks.push_back(stack);
+    else
+        munmap(stack, task_stack_size);
+}
+
+// Puts t back on its scheduler's ready queue, from whichever thread.
+void task_wake(Task *t)
+{
+    Scheduler *owner = t->owner;
+    if (owner == &scheduler)
+    {
+        owner->ready.push_back(t);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(owner->lock);
+    owner->inbox.push_back(t);
+    owner->wake.notify_one();
+}
+
+// A task that goes over the budget of its run ends here with 0, without
+// taking the thread's stack with it.
+void task_start()
+{
+    Scheduler &s = scheduler;
+    Task *t = s.current;
+
+    jmp_buf escape;
+    if (setjmp(escape) == 0)
+    {
+        mem_escape = &escape;
+        t->result = call_value(t->fn);
+    }
+    else
+    {
+        t->result = 0;
+    }
+
+    mem_escape = nullptr;
+
+    std::vector<Task *> waiters;
+    std::vector<Scheduler *> stack_waiters;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->done = true;
+        waiters.swap(t->waiters);
+        stack_waiters.swap(t->stack_waiters);
+    }
+
+    for (auto it = waiters.begin(); it != waiters.end(); ++it)
+    {
+        task_wake(*it);
+    }
+
+    for (auto it = stack_waiters.begin(); it != stack_waiters.end(); ++it)
+    {
+        std::lock_guard<std::mutex> guard((*it)->lock);
+        (*it)->wake.notify_all();
+    }
+
+    s.finished = t;
+    task_switch(&t->sp, s.thread_sp);
+}
+
+// Only the thread's own stack resumes tasks, and a task always switches
+// back to it.
+void task_resume(Scheduler &s, Task *t)
+{
+    jmp_buf *escape = mem_escape;
+    mem_escape = t->escape;
+
+    s.current = t;
+    task_switch(&s.thread_sp, t->sp);
+    s.current = nullptr;
+
+    mem_escape = escape;
+
+    if (s.finished != nullptr)
+    {
+        task_stack_release(s, s.finished->stack);
+        s.finished->stack = nullptr;
+        s.finished = nullptr;
+    }
+}
+
+void task_suspend(Scheduler &s)
+{
+    s.current->escape = mem_escape;
+    task_switch(&s.current->sp, s.thread_sp);
+}
+
+// Requests complete on the thread that made them, which is the thread of
+// the task that waits for them.
+void io_complete(IoRequest *r)
+{
+    r->done = true;
+    if (r->task != nullptr)
+        task_wake(r->task);
+}
+
+void take_inbox(Scheduler &s)
+{
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.ready.insert(s.ready.end(), s.inbox.begin(), s.inbox.end());
+    s.inbox.clear();
+}
+
+// Runs tasks and waits for I/O and for tasks of other threads on the
+// thread's own stack until done() holds; false if nothing is left that
+// could make it hold.
+template <typename Done>
+bool run_until(Done done)
+{
+    Scheduler &s = scheduler;
+    while (!done())
+    {
+        if (s.ready.empty())
+            take_inbox(s);
+
+        if (!s.ready.empty())
+        {
+            Task *t = s.ready.front();
+            s.ready.pop_front();
+            task_resume(s, t);
+            continue;
+        }
+
+        if (io_wait())
+            continue;
+
+        if (s.foreign_waits == 0)
+            return false;
+
+        std::unique_lock<std::mutex> guard(s.lock);
+        s.wake.wait(guard, [&] { return !s.inbox.empty() || done(); });
+    }
+
+    return true;
+}
+
+// Resumes one task that is ready, if the thread is on its own stack;
+// false when there was none. For threads that wait for something else.
+bool async_step()
+{
+    Scheduler &s = scheduler;
+    if (s.current != nullptr)
+        return false;
+
+    io_poll();
+    if (s.ready.empty())
+        take_inbox(s);
+    if (s.ready.empty())
+        return false;
+
+    Task *t = s.ready.front();
+    s.ready.pop_front();
+    task_resume(s, t);
+    return true;
+}
+
+// Runs the tasks that are left, at the end of a program.
+void async_drain()
+{
+    run_until([] { return false; });
+}
+
+// After a chunk of a parallel body, so that the tasks it spawned do not sit
+// on a pool thread that goes back to waiting for work. A chunk run inside a
+// task leaves them to the thread's own stack.
+void async_finish_chunk()
+{
+    if (scheduler.current == nullptr)
+        async_drain();
+}
+
+// Calls run and then the tasks it left with a budget of their own; false
+// when they went over it. The run is then left at its next allocation, and
+// its tasks end at theirs.
+template <typename Run>
+bool run_budgeted(Run run)
+{
+    MemBudget budget;
+    mem_budget_init(budget, mem_limit);
+    MemBudgetScope scope(&budget);
+
+    jmp_buf escape;
+    jmp_buf *saved = mem_escape;
+    if (setjmp(escape) == 0)
+    {
+        mem_escape = &escape;
+        run();
+    }
+
+    mem_escape = saved;
+    async_drain();
+    return !budget.exceeded;
+}
+
+// The stack starts out as if task_switch had been called from task_start:
+// control words, six registers and the return address, with the stack
+// aligned as after a call once task_start is entered. Without a stack
+// there is no task, and spawn returns 0, which await gives back as is.
+Task *spawn_task(uint64_t fn)
+{
+    Scheduler &s = scheduler;
+
+    Task *t = (Task *)setup_object(new Task(), task_type);
+    t->fn = fn;
+    t->owner = &s;
+    t->stack = task_stack_acquire(s);
+    if (t->stack == nullptr)
+    {
+        delete t;
+        return nullptr;
+    }
+
+    uint64_t *top = (uint64_t *)(t->stack + task_stack_size);
+    top[-1] = 0;
+    top[-2] = (uint64_t)(uintptr_t)task_start;
+    for (int i = 3; i <= 8; i++)
+    {
+        top[-i] = 0;
+    }
+    top[-9] = 0x1f80 | ((uint64_t)0x037f << 32);
+    t->sp = &top[-9];
+
+    s.ready.push_back(t);
+    return t;
+}
+
+uint64_t await_task(uint64_t value)
+{
+    if (!isObj(value) || !isObjType(value, task_type->type_number))
+        return 0;
+
+    Task *t = (Task *)valueToObj(value);
+    Scheduler &s = scheduler;
+
+    if (t->done)
+        return t->result;
+
+    if (s.current == t)
+        return 0;
+
+    bool foreign = t->owner != &s;
+    bool waiting;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        waiting = !t->done;
+        if (waiting && s.current != nullptr)
+            t->waiters.push_back(s.current);
+        else if (waiting && foreign)
+            t->stack_waiters.push_back(&s);
+    }
+
+    if (!waiting)
+        return t->result;
+
+    if (foreign)
+        s.foreign_waits++;
+
+    bool done = true;
+    if (s.current != nullptr)
+        task_suspend(s);
+    else
+        done = run_until([t] { return t->done.load(); });
+
+    if (foreign)
+        s.foreign_waits--;
+
+    return done ? t->result : 0;
+}
+
+// One read or write, suspending the running task until it is done.
+int64_t io_run(bool write, int fd, char *data, size_t size, int64_t offset)
+{
+    Scheduler &s = scheduler;
+
+    IoRequest r = {};
+    r.write = write;
+    r.fd = fd;
+    r.iov.iov_base = data;
+    r.iov.iov_len = size;
+    r.offset = offset;
+    r.task = s.current;
+
+    io_submit(r);
+
+    // Either way this only returns once the request is done, since
+    // io_wait keeps waiting while any is in flight.
+    if (s.current != nullptr)
+        task_suspend(s);
+    else
+        run_until([&r] { return r.done; });
+
+    return r.result;
+}
+
+std::string string_path(Str path)
+{
+    char buffer[24];
+    int64_t length;
+    const char *chars = string_text(path.value, buffer, &length);
+
+    return std::string(chars != nullptr ? chars : "", chars != nullptr ? length : 0);
+}
+
+// Regular files are read in one request of their size, anything else in
+// growing chunks until the end.
+bool read_whole(Str path, std::string &text)
+{
+    int fd = open(string_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    size_t size = 0;
+    text.resize(regular && st.st_size > 0 ? st.st_size : 1 << 16);
+
+    while (true)
+    {
+        int64_t n = io_run(false, fd, &text[size], text.size() - size, size);
+        if (n < 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        size += n;
+        if (n == 0 || (regular && size == text.size()))
+            break;
+
+        if (size == text.size())
+            text.resize(text.size() * 2);
+    }
+
+    close(fd);
+    text.resize(size);
+    return true;
+}
+
+// The file builtins hold strings of their own, so runs over their budget
+// are not left from inside them.
+
+// The text of the file, or 0 when it cannot be read.
+Str read_file(Str path)
+{
+    MemNoEscape no_escape;
+    std::string text;
+    if (!read_whole(path, text))
+        return {0};
+
+    return {make_string(text.data(), text.size())};
+}
+
+// Lines without their newlines; empty when the file cannot be read.
+List *read_lines(Str path)
+{
+    MemNoEscape no_escape;
+    List *lines = make_list();
+
+    std::string text;
+    if (!read_whole(path, text))
+        return lines;
+
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+            end = text.size();
+
+        list_add_element(lines, make_string(text.data() + start, end - start));
+        start = end + 1;
+    }
+
+    return lines;
+}
+
+// Bytes written, or -1 when the file cannot be written.
+int64_t write_file(Str path, Str text)
+{
+    MemNoEscape no_escape;
+    char buffer[24];
+    int64_t length;
+    const char *chars = string_text(text.value, buffer, &length);
+    if (chars == nullptr)
+        return -1;
+
+    int fd = open(string_path(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    int64_t written = 0;
+    while (written < length)
+    {
+        int64_t n = io_run(true, fd, (char *)chars + written, length - written, written);
+        if (n <= 0)
+        {
+            written = -1;
+            break;
+        }
+
+        written += n;
+    }
+
+    close(fd);
+    return written;
+}
@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <string>
+#include <set>
+#include <utility>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+enum BenchPhase
+{
+    PHASE_PARSE,
+    PHASE_CODEGEN,
+    PHASE_FINALIZE,
+    PHASE_LOAD,
+    PHASE_RUN,
+
+    PHASE_COUNT,
+};
+
+const char *phase_names[PHASE_COUNT] = { "parse", "codegen", "finalize", "load", "run" };
+
+struct PhaseSample
+{
+    double wall_ms;
+    int64_t instructions;
+
+    // Highest RSS of the process while it was in the phase. Without
+    // /proc/self/clear_refs this is the peak of the process so far.
+    long peak_rss_kb;
+};
+
+struct BenchReport
+{
+    bool enabled;
+    int instruction_fd;
+    PhaseSample phases[PHASE_COUNT];
+
+    // /proc/self/clear_refs, which resets the peak RSS to the current RSS
+    // when "5" is written to it; -1 when there is none.
+    int clear_refs_fd;
+
+    // Start of the phase that is currently being measured.
+    double start_ms;
+    int64_t start_instructions;
+};
+
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// VmHWM of /proc/self/status, which clear_refs resets, or ru_maxrss.
+long peak_rss_kb()
+{
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd >= 0)
+    {
+        char status[4096];
+        ssize_t n = read(fd, status, sizeof(status) - 1);
+        close(fd);
+
+        if (n > 0)
+        {
+            status[n] = 0;
+            if (const char *hwm = strstr(status, "VmHWM:"))
+                return strtol(hwm + 6, nullptr, 10);
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Opens a user-space retired instruction counter for this thread, or returns
+// -1 when the kernel does not allow it (containers, perf_event_paranoid).
+int open_instruction_counter()
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+int64_t read_instructions(BenchReport &report)
+{
+    if (report.instruction_fd < 0)
+        return 0;
+
+    int64_t count = 0;
+    if (read(report.instruction_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+
+    return count;
+}
+
+void bench_init(BenchReport &report, bool enabled)
+{
+    memset(&report, 0, sizeof(report));
+    report.enabled = enabled;
+    report.instruction_fd = enabled ? open_instruction_counter() : -1;
+    report.clear_refs_fd = enabled ? open("/proc/self/clear_refs", O_WRONLY) : -1;
+}
+
+// Phases can be entered many times (parsing and codegen of top-level
+// statements interleave), so every sample accumulates.
+void bench_start(BenchReport &report)
+{
+    if (!report.enabled)
+        return;
+
+    if (report.clear_refs_fd >= 0 && write(report.clear_refs_fd, "5", 1) != 1)
+    {
+        close(report.clear_refs_fd);
+        report.clear_refs_fd = -1;
+    }
+
+    report.start_instructions = read_instructions(report);
+    report.start_ms = now_ms();
+}
+
+void bench_stop(BenchReport &report, BenchPhase phase)
+{
+    if (!report.enabled)
+        return;
+
+    double end = now_ms();
+    int64_t instructions = read_instructions(report);
+
+    PhaseSample &sample = report.phases[phase];
+    sample.wall_ms += end - report.start_ms;
+    sample.instructions += instructions - report.start_instructions;
+    sample.peak_rss_kb = std::max(sample.peak_rss_kb, peak_rss_kb());
+}
+
+// Appends one JSON object per line so results of different versions can be
+// concatenated and compared with bench/compare.py.
+void bench_write(BenchReport &report, const char *path, const char *script)
+{
+    if (!report.enabled)
+        return;
+
+    FILE *f = fopen(path, "a");
+    if (f == nullptr)
+    {
+        printf("COULD NOT OPEN %s\n", path);
+        return;
+    }
+
+    fprintf(f, "{\"script\": \"%s\"", script);
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        PhaseSample &sample = report.phases[i];
+        fprintf(f, ", \"%s\": {\"wall_ms\": %.3f, \"instructions\": ", phase_names[i], sample.wall_ms);
+
+        if (report.instruction_fd < 0)
+            fprintf(f, "null");
+        else
+            fprintf(f, "%lld", (long long)sample.instructions);
+
+        fprintf(f, ", \"peak_rss_kb\": %ld}", sample.peak_rss_kb);
+    }
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
+
+void bench_print(BenchReport &report, FILE *f)
+{
+    fprintf(f, "%-10s %12s %16s %16s\n", "phase", "wall_ms", "instructions", "peak_rss_kb");
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        PhaseSample &sample = report.phases[i];
+        fprintf(f, "%-10s %12.3f %16lld %16ld\n", phase_names[i], sample.wall_ms,
+                report.instruction_fd < 0 ? -1LL : (long long)sample.instructions, sample.peak_rss_kb);
+    }
+}
+
+struct CompileStats
+{
+    bool enabled;
+    int64_t nodes[TYPE_COUNT];
+    int functions;
+    size_t code_bytes;
+
+    // 4K pages the code spans, and the functions that ran (or ran in the
+    // profile the code was laid out by) with the pages they span.
+    size_t code_pages;
+    int hot_functions;
+    size_t hot_bytes;
+    size_t hot_pages;
+
+    // Constant pool entries as (function, value); global scope uses -1.
+    // asmjit deduplicates within a pool, so this mirrors its entry count.
+    std::set<std::pair<int, int64_t>> constants;
+};
+
+CompileStats compile_stats;
+
+void count_nodes(ProgramData *data, CompileStats &stats)
+{
+    if (data == nullptr)
+        return;
+
+    stats.nodes[data->type]++;
+
+    if (!has_children(data->type))
+        return;
+
+    auto &vec = (*data->value.children);
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+        count_nodes((*it).get(), stats);
+    }
+}
+
+void stats_print(CompileStats &stats, FILE *f)
+{
+    int64_t total = 0;
+    for (int i = 0; i < TYPE_COUNT; i++)
+    {
+        total += stats.nodes[i];
+    }
+
+    fprintf(f, "ast nodes: %lld\n", (long long)total);
+    for (int i = 0; i < TYPE_COUNT; i++)
+    {
+        if (stats.nodes[i] != 0)
+            fprintf(f, "    %-12s %lld\n", program_type_names[i], (long long)stats.nodes[i]);
+    }
+
+    fprintf(f, "functions: %d\n", stats.functions);
+    fprintf(f, "code bytes: %zu\n", stats.code_bytes);
+    fprintf(f, "code pages: %zu (%zu bytes per page)\n", stats.code_pages,
+            stats.code_pages == 0 ? (size_t)0 : stats.code_bytes / stats.code_pages);
+    if (stats.hot_functions > 0)
+        fprintf(f, "hot functions: %d (%zu bytes in %zu pages)\n", stats.hot_functions, stats.hot_bytes, stats.hot_pages);
+    fprintf(f, "constant pool: %zu entries (%zu bytes)\n", stats.constants.size(), stats.constants.size() * 8);
+}
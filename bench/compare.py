@@ -0,0 +1,56 @@
+import json
+import sys
+
+# Compares two result files written by `a.out --bench` and reports phases
+# that got slower than the threshold. Exits non-zero on any regression.
+
+PHASES = ["parse", "codegen", "finalize", "load", "run"]
+METRICS = ["wall_ms", "instructions", "peak_rss_kb"]
+
+
+def load(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                record = json.loads(line)
+                results[record["script"]] = record
+    return results
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("usage: compare.py baseline.jsonl current.jsonl [threshold]")
+        return 2
+
+    base = load(sys.argv[1])
+    current = load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 0.10
+
+    regressions = 0
+    for script, record in sorted(current.items()):
+        if script not in base:
+            continue
+
+        for phase in PHASES:
+            for metric in METRICS:
+                old = base[script][phase][metric]
+                new = record[phase][metric]
+                if old is None or new is None or old <= 0:
+                    continue
+
+                change = (new - old) / old
+                flag = ""
+                if change > threshold:
+                    flag = "  REGRESSION"
+                    regressions += 1
+
+                print("%-40s %-9s %-13s %14.3f -> %14.3f %+7.1f%%%s"
+                      % (script, phase, metric, old, new, change * 100, flag))
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
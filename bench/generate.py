@@ -0,0 +1,106 @@
+import os
+import random
+import sys
+
+# Generates the synthetic part of the benchmark corpus. Identifiers in the
+# language are letters only, so numbered names are spelled in base 26.
+
+
+def name(n, prefix="f"):
+    s = ""
+    while True:
+        s = chr(ord("a") + n % 26) + s
+        n //= 26
+        if n == 0:
+            return prefix + s
+
+
+def deep_calls(depth, calls):
+    # Bodies are nested rather than indented so the file size stays linear
+    # in the depth.
+    lines = []
+    for d in range(depth):
+        lines.append(name(d) + " = function() {")
+    lines.append("return 1")
+    for d in reversed(range(depth)):
+        if d != depth - 1:
+            lines.append("return " + name(d + 1) + "() + 1")
+        lines.append("}")
+
+    lines.append("i = 0")
+    lines.append("total = 0")
+    lines.append("while (i < %d) {" % calls)
+    lines.append("    total = total + " + name(0) + "()")
+    lines.append("    i = i + 1")
+    lines.append("}")
+    lines.append("print(total)")
+    return "\n".join(lines) + "\n"
+
+
+def large_source(statements, seed=1):
+    rng = random.Random(seed)
+    variables = [name(i, "v") for i in range(16)]
+    lines = [v + " = " + str(i) for i, v in enumerate(variables)]
+
+    def operand():
+        if rng.random() < 0.5:
+            return rng.choice(variables)
+        return str(rng.randint(1, 100))
+
+    def arith():
+        ops = ["+", "-", "*"]
+        expr = operand()
+        for _ in range(rng.randint(1, 6)):
+            expr += " " + rng.choice(ops) + " " + operand()
+        return expr
+
+    for _ in range(statements):
+        kind = rng.random()
+        target = rng.choice(variables)
+        if kind < 0.7:
+            lines.append(target + " = " + arith())
+        elif kind < 0.9:
+            lines.append("if (" + operand() + " < " + operand() + ") {")
+            lines.append("    " + target + " = " + arith())
+            lines.append("} else {")
+            lines.append("    " + target + " = " + arith())
+            lines.append("}")
+        else:
+            lines.append(target + " = 0")
+            lines.append("while (" + target + " < 10) {")
+            lines.append("    " + target + " = " + target + " + 1")
+            lines.append("}")
+
+    lines.append("print(" + variables[0] + ")")
+    return "\n".join(lines) + "\n"
+
+
+def many_functions(count):
+    lines = ["total = 0"]
+    for i in range(count):
+        lines.append("f = function() {")
+        lines.append("    a = %d" % i)
+        lines.append("    return a * 2 + 1")
+        lines.append("}")
+        lines.append("total = total + f()")
+    lines.append("print(total)")
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    out = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "gen")
+    os.makedirs(out, exist_ok=True)
+
+    corpus = {
+        "deep_calls.txt": deep_calls(200, 20000),
+        "large_generated.txt": large_source(2000),
+        "many_functions.txt": many_functions(1000),
+    }
+
+    for file_name, source in corpus.items():
+        with open(os.path.join(out, file_name), "w") as f:
+            f.write(source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,190 @@
+#include <type_traits>
+
+// Binding layer for native functions. The signature of the C++ function is
+// turned into a thunk that takes and returns tagged values, the asmjit
+// signature used at call sites and the function's Type, all at C++ compile
+// time. A function that already works on tagged values is called directly.
+//
+//     BIND_FUNCTION(s, "make_list", make_list);
+//     BIND_METHOD(list_type, "count", list_count);
+
+// Conversion between tagged values and the C++ types natives can use.
+// Natives that make objects return them by their C++ type (List *, not a
+// tagged uint64_t), since the return type is all the compiler learns about
+// the result: a list returned as uint64_t has no type, and l.add() on it
+// fails to compile.
+template <typename T>
+struct ValueTraits;
+
+template <>
+struct ValueTraits<uint64_t>
+{
+    static uint64_t from_value(uint64_t value) { return value; }
+    static uint64_t to_value(uint64_t value) { return value; }
+    static Type *type() { return nullptr; }
+};
+
+template <>
+struct ValueTraits<int64_t>
+{
+    static int64_t from_value(uint64_t value) { return valueToNum(value); }
+    static uint64_t to_value(int64_t value) { return (uint64_t)value; }
+    static Type *type() { return nullptr; }
+};
+
+template <>
+struct ValueTraits<int>
+{
+    static int from_value(uint64_t value) { return (int)valueToNum(value); }
+    static uint64_t to_value(int value) { return (uint64_t)(int64_t)value; }
+    static Type *type() { return nullptr; }
+};
+
+template <>
+struct ValueTraits<bool>
+{
+    static bool from_value(uint64_t value) { return value != 0; }
+    static uint64_t to_value(bool value) { return value ? 1 : 0; }
+    static Type *type() { return nullptr; }
+};
+
+template <>
+struct ValueTraits<List *>
+{
+    static List *from_value(uint64_t value) { return (List *)valueToObj(value); }
+    static uint64_t to_value(List *value) { return objToValue(value); }
+    static Type *type() { return list_type; }
+};
+
+template <>
+struct ValueTraits<Map *>
+{
+    static Map *from_value(uint64_t value) { return (Map *)valueToObj(value); }
+    static uint64_t to_value(Map *value) { return objToValue(value); }
+    static Type *type() { return map_type; }
+};
+
+template <>
+struct ValueTraits<Task *>
+{
+    static Task *from_value(uint64_t value) { return (Task *)valueToObj(value); }
+    static uint64_t to_value(Task *value) { return value != nullptr ? objToValue(value) : 0; }
+    static Type *type() { return task_type; }
+};
+
+template <>
+struct ValueTraits<Str>
+{
+    static Str from_value(uint64_t value) { return {value}; }
+    static uint64_t to_value(Str value) { return value.value; }
+    static Type *type() { return string_type; }
+};
+
+template <>
+struct ValueTraits<generic_fp>
+{
+    static generic_fp from_value(uint64_t value) { return valueToFunc(value); }
+    static uint64_t to_value(generic_fp value) { return funcToValue(value); }
+    static Type *type() { return get_return_type(nullptr); }
+};
+
+// Natives returning void give back 0.
+template <>
+struct ValueTraits<void>
+{
+    static Type *type() { return nullptr; }
+};
+
+template <typename T>
+struct AsValue
+{
+    typedef uint64_t type;
+};
+
+template <typename... Args>
+struct AllTagged;
+
+template <>
+struct AllTagged<>
+{
+    static const bool value = true;
+};
+
+template <typename T, typename... Rest>
+struct AllTagged<T, Rest...>
+{
+    static const bool value = std::is_same<T, uint64_t>::value && AllTagged<Rest...>::value;
+};
+
+template <typename R>
+struct CallNative
+{
+    template <typename F, typename... Args>
+    static uint64_t call(F f, Args... args)
+    {
+        return ValueTraits<R>::to_value(f(args...));
+    }
+};
+
+template <>
+struct CallNative<void>
+{
+    template <typename F, typename... Args>
+    static uint64_t call(F f, Args... args)
+    {
+        f(args...);
+        return 0;
+    }
+};
+
+template <typename F, F f>
+struct Native;
+
+template <typename R, typename... Args, R (*f)(Args...)>
+struct Native<R (*)(Args...), f>
+{
+    static const int arity = sizeof...(Args);
+
+    static uint64_t thunk(typename AsValue<Args>::type... args)
+    {
+        return CallNative<R>::call(f, ValueTraits<Args>::from_value(args)...);
+    }
+
+    static generic_fp address()
+    {
+        if (std::is_same<R, uint64_t>::value && AllTagged<Args...>::value)
+            return (generic_fp)f;
+
+        return (generic_fp)thunk;
+    }
+
+    static const FuncSignature *signature()
+    {
+        static FuncSignatureT<uint64_t, typename AsValue<Args>::type...> sig(CallConv::kIdHost);
+        return &sig;
+    }
+
+    static Type *function_type()
+    {
+        return get_function_type(ValueTraits<R>::type(), arity, signature());
+    }
+};
+
+template <typename F, F f>
+void bind_function(JitState &s, const char *name)
+{
+    s.globals.set(intern(name), {Native<F, f>::function_type(), funcToValue(Native<F, f>::address())});
+}
+
+// The receiver is the first argument of a method.
+template <typename F, F f>
+void bind_method(Type *t, const char *name)
+{
+    add_function(t, name, true, Native<F, f>::address(), Native<F, f>::function_type());
+}
+
+// For compiled code that calls a native itself.
+#define NATIVE(f) Native<decltype(&f), &f>
+
+#define BIND_FUNCTION(state, name, f) bind_function<decltype(&f), &f>(state, name)
+#define BIND_METHOD(type, name, f) bind_method<decltype(&f), &f>(type, name)
@@ -0,0 +1,95 @@
+// Bounds check elimination. In a loop of the form
+//
+//     i = 0
+//     while (i < l.count()) {
+//         ... l[i] ...
+//         i = i + 1
+//     }
+//
+// where nothing else in the body assigns i or l, every l[i] in the body is
+// in range: the condition gives i < l.count() up to the last statement,
+// lists never shrink, and i starts out non-negative and only grows. The
+// statement before the loop is checked by the compiler, which knows the
+// previous statement even across top-level statements; this only looks at
+// the loop itself.
+
+bool assigns(ProgramData *node, int symbol)
+{
+    if (node == nullptr || !has_children(node->type))
+        return false;
+
+    auto &vec = (*node->value.children);
+    if (node->type == TYPE_ASSIGNMENT && vec[0]->type == TYPE_IDENTIFIER && vec[0]->value.symbol == symbol)
+        return true;
+
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+        if (assigns((*it).get(), symbol))
+            return true;
+    }
+
+    return false;
+}
+
+// i = i + k, with k a non-negative constant.
+bool is_increment(ProgramData *node, int symbol)
+{
+    if (node->type != TYPE_ASSIGNMENT)
+        return false;
+
+    auto &vec = (*node->value.children);
+    if (vec[0]->type != TYPE_IDENTIFIER || vec[0]->value.symbol != symbol || vec[1]->type != TYPE_ADD)
+        return false;
+
+    auto &add = (*vec[1]->value.children);
+    ProgramData *step = add[0]->type == TYPE_IDENTIFIER ? add[1].get() : add[0].get();
+    ProgramData *var = add[0]->type == TYPE_IDENTIFIER ? add[0].get() : add[1].get();
+
+    return var->type == TYPE_IDENTIFIER && var->value.symbol == symbol &&
+           step->type == TYPE_INTEGER && step->value.integer >= 0;
+}
+
+// Whether loop has the form above, and if so its index and list.
+bool counted_loop(ProgramData *loop, int &index, int &list)
+{
+    static const int count_symbol = intern("count");
+
+    auto &vec = (*loop->value.children);
+    ProgramData *cond = vec[0].get();
+    ProgramData *body = vec[1].get();
+
+    if (cond->type != TYPE_LT)
+        return false;
+
+    auto &lt = (*cond->value.children);
+    if (lt[0]->type != TYPE_IDENTIFIER || lt[1]->type != TYPE_FUNCTION)
+        return false;
+
+    auto &call = (*lt[1]->value.children);
+    if (call.size() != 1 || call[0]->type != TYPE_INDEX)
+        return false;
+
+    auto &callee = (*call[0]->value.children);
+    if (callee[0]->type != TYPE_IDENTIFIER || callee[1]->value.symbol != count_symbol)
+        return false;
+
+    index = lt[0]->value.symbol;
+    list = callee[0]->value.symbol;
+    if (index == list)
+        return false;
+
+    auto &statements = (*body->value.children);
+    if (statements.empty() || !is_increment(statements.back().get(), index))
+        return false;
+
+    for (size_t i = 0; i < statements.size(); i++)
+    {
+        if (assigns(statements[i].get(), list))
+            return false;
+
+        if (i + 1 < statements.size() && assigns(statements[i].get(), index))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+// Closure analysis. Runs over one top-level statement, including every
+// function nested in it, before the statement is compiled. For each
+// function it decides how the function is passed around (its kind) and
+// how it receives the variables it captures, and for every captured
+// variable where the function that owns it keeps it (its home).
+//
+// Variables only read by closures that cannot outlive the current call
+// stay in registers and are passed by value. Variables written by such
+// closures are kept in a stack slot and passed by address. Only variables
+// that are captured by a closure that escapes, and can change after it was
+// created, are moved to a heap box.
+//
+// Variables of the top level are not captured at all: once a function
+// uses one, it moves to a module global slot, which every function reads
+// and writes in place. Functions of the top level therefore never have
+// captures.
+
+enum ClosureKind
+{
+    // No captures; the value is the code address.
+    CLOSURE_PLAIN,
+
+    // Only ever called by name from the function that defines it, so
+    // captures are appended to the arguments of every call.
+    CLOSURE_DIRECT,
+
+    // Only passed to natives that do not keep it past the call, so the
+    // closure object lives in the defining function's frame.
+    CLOSURE_STACK,
+
+    // Closure object allocated on the heap.
+    CLOSURE_HEAP,
+};
+
+struct Capture
+{
+    int symbol;
+    bool pointer;
+};
+
+struct FunctionAnalysis
+{
+    ClosureKind kind;
+    std::vector<Capture> captures;
+
+    // Own locals (parameters included) that do not live in a register.
+    SymbolMap<VarHome> homes;
+
+    // Variables of the top level the function uses.
+    std::vector<int> globals;
+};
+
+struct ClosureAnalysis
+{
+    std::unordered_map<ProgramData *, FunctionAnalysis> functions;
+    FunctionAnalysis entry;
+};
+
+enum UseContext
+{
+    USE_OTHER,
+    USE_CALLEE,
+    USE_BORROWED,
+};
+
+struct LocalInfo
+{
+    bool param;
+    int assignments;
+    bool assigned_in_loop;
+    bool written_by_closure;
+    int call_uses;
+    int borrowed_uses;
+    int other_uses;
+};
+
+struct Frame
+{
+    ProgramData *def;
+    Frame *parent;
+    bool entry;
+    int self;
+    bool self_escapes;
+
+    // How the definition is used in the parent: USE_OTHER, USE_BORROWED
+    // or, when assigned, USE_CALLEE with the name in assigned_to.
+    UseContext context;
+    int assigned_to;
+
+    SymbolMap<LocalInfo> locals;
+    // Captured symbols, and their position in captures.
+    SymbolMap<int> captured;
+    std::vector<int> captures;
+    std::vector<int> globals;
+    std::vector<Frame *> children;
+};
+
+struct CaptureChain
+{
+    Frame *inner;
+    Frame *owner;
+    int symbol;
+};
+
+struct AnalysisState
+{
+    std::deque<Frame> frames;
+    std::vector<CaptureChain> chains;
+    SymbolMap<GlobalVar> *globals;
+};
+
+Frame *find_owner(Frame *frame, int symbol)
+{
+    for (Frame *f = frame; f != nullptr; f = f->parent)
+    {
+        if (f->locals.find(symbol) != nullptr)
+            return f;
+    }
+
+    return nullptr;
+}
+
+void collect_locals(Frame &frame, ProgramData *node, int loop)
+{
+    if (node == nullptr || !has_children(node->type) || node->type == TYPE_FUNCTION_DEF)
+        return;
+
+    auto &vec = (*node->value.children);
+
+    if (node->type == TYPE_ASSIGNMENT && vec[0]->type == TYPE_IDENTIFIER)
+    {
+        int symbol = vec[0]->value.symbol;
+        LocalInfo *info = frame.locals.find(symbol);
+
+        // Assigning a variable of an enclosing function writes that
+        // variable instead of declaring a new one.
+        if (info == nullptr && find_owner(frame.parent, symbol) == nullptr)
+            info = &frame.locals.insert(symbol, {});
+
+        if (info != nullptr)
+        {
+            info->assignments++;
+            if (loop > 0)
+                info->assigned_in_loop = true;
+        }
+    }
+
+    int inner = node->type == TYPE_WHILE ? loop + 1 : loop;
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+        collect_locals(frame, (*it).get(), inner);
+    }
+}
+
+void capture(AnalysisState &an, Frame &frame, Frame *owner, int symbol)
+{
+    for (Frame *f = &frame; f != owner; f = f->parent)
+    {
+        if (f->captured.find(symbol) == nullptr)
+        {
+            f->captured.insert(symbol, f->captures.size());
+            f->captures.push_back(symbol);
+        }
+    }
+
+    an.chains.push_back({&frame, owner, symbol});
+}
+
+void use_symbol(AnalysisState &an, Frame &frame, int symbol, UseContext context, bool write)
+{
+    if (LocalInfo *info = frame.locals.find(symbol))
+    {
+        if (context == USE_CALLEE)
+            info->call_uses++;
+        else if (context == USE_BORROWED)
+            info->borrowed_uses++;
+        else if (!write)
+            info->other_uses++;
+
+        return;
+    }
+
+    if (symbol == frame.self && !write)
+    {
+        if (context != USE_CALLEE)
+            frame.self_escapes = true;
+
+        return;
+    }
+
+    Frame *owner = find_owner(frame.parent, symbol);
+    if (owner == nullptr)
+        return;
+
+    LocalInfo *info = owner->locals.find(symbol);
+    info->other_uses++;
+    if (write)
+        info->written_by_closure = true;
+
+    if (owner->entry)
+    {
+        if (std::find(frame.globals.begin(), frame.globals.end(), symbol) == frame.globals.end())
+            frame.globals.push_back(symbol);
+        return;
+    }
+
+    capture(an, frame, owner, symbol);
+}
+
+bool is_borrowing_call(AnalysisState &an, Frame &frame, ProgramData *callee)
+{
+    if (callee->type != TYPE_IDENTIFIER)
+        return false;
+
+    int symbol = callee->value.symbol;
+    if (find_owner(&frame, symbol) != nullptr || symbol == frame.self)
+        return false;
+
+    GlobalVar *global = an.globals->find(symbol);
+    return global != nullptr && global->borrows;
+}
+
+void analyze_frame(AnalysisState &an, Frame &frame);
+
+void add_child(AnalysisState &an, Frame &frame, ProgramData *def, UseContext context, int assigned_to)
+{
+    an.frames.push_back({});
+    Frame &child = an.frames.back();
+
+    child.def = def;
+    child.parent = &frame;
+    child.self = context == USE_CALLEE ? assigned_to : -1;
+    child.context = context;
+    child.assigned_to = assigned_to;
+
+    auto &vec = (*def->value.children);
+    for (auto it = ++vec.begin(); it != vec.end(); ++it)
+    {
+        child.locals.insert((*it)->value.symbol, {true});
+    }
+
+    frame.children.push_back(&child);
+}
+
+void walk_uses(AnalysisState &an, Frame &frame, ProgramData *node, UseContext context)
+{
+    if (node == nullptr)
+        return;
+
+    if (node->type == TYPE_IDENTIFIER)
+    {
+        use_symbol(an, frame, node->value.symbol, context, false);
+        return;
+    }
+
+    if (node->type == TYPE_FUNCTION_DEF)
+    {
+        add_child(an, frame, node, context == USE_BORROWED ? USE_BORROWED : USE_OTHER, -1);
+        return;
+    }
+
+    if (!has_children(node->type))
+        return;
+
+    auto &vec = (*node->value.children);
+
+    if (node->type == TYPE_ASSIGNMENT && vec[0]->type == TYPE_IDENTIFIER)
+    {
+        int symbol = vec[0]->value.symbol;
+        use_symbol(an, frame, symbol, USE_OTHER, true);
+
+        if (vec[1]->type == TYPE_FUNCTION_DEF && frame.locals.find(symbol) != nullptr)
+            add_child(an, frame, vec[1].get(), USE_CALLEE, symbol);
+        else
+            walk_uses(an, frame, vec[1].get(), USE_OTHER);
+
+        return;
+    }
+
+    if (node->type == TYPE_INDEX)
+    {
+        walk_uses(an, frame, vec[0].get(), USE_OTHER);
+        return;
+    }
+
+    // Field names of object literals are not variables.
+    if (node->type == TYPE_OBJECT)
+    {
+        for (size_t i = 1; i < vec.size(); i += 2)
+        {
+            walk_uses(an, frame, vec[i].get(), USE_OTHER);
+        }
+
+        return;
+    }
+
+    if (node->type == TYPE_FUNCTION)
+    {
+        bool borrow = is_borrowing_call(an, frame, vec[0].get());
+        walk_uses(an, frame, vec[0].get(), USE_CALLEE);
+
+        for (auto it = ++vec.begin(); it != vec.end(); ++it)
+        {
+            walk_uses(an, frame, (*it).get(), borrow ? USE_BORROWED : USE_OTHER);
+        }
+
+        return;
+    }
+
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+        walk_uses(an, frame, (*it).get(), USE_OTHER);
+    }
+}
+
+// Locals of a function are known before its nested functions are looked
+// at, so an assignment in a nested function can tell whether it writes an
+// outer variable.
+void analyze_frame(AnalysisState &an, Frame &frame)
+{
+    ProgramData *body = frame.def != nullptr ? (*frame.def->value.children)[0].get() : nullptr;
+    if (body != nullptr)
+    {
+        collect_locals(frame, body, 0);
+        walk_uses(an, frame, body, USE_OTHER);
+    }
+
+    for (auto it = frame.children.begin(); it != frame.children.end(); ++it)
+    {
+        analyze_frame(an, **it);
+    }
+}
+
+ClosureKind closure_kind(Frame &frame)
+{
+    if (frame.captures.empty())
+        return CLOSURE_PLAIN;
+
+    if (frame.context == USE_BORROWED)
+        return CLOSURE_STACK;
+
+    if (frame.context != USE_CALLEE || frame.parent->entry || frame.self_escapes)
+        return CLOSURE_HEAP;
+
+    // Statements that come later in the entry function are not known, so
+    // names there are never trusted to stay local.
+    LocalInfo *info = frame.parent->locals.find(frame.assigned_to);
+    if (info->param || info->assignments != 1 || info->other_uses != 0)
+        return CLOSURE_HEAP;
+
+    return info->borrowed_uses == 0 ? CLOSURE_DIRECT : CLOSURE_STACK;
+}
+
+// Whether a variable can change after a closure captured it.
+bool is_mutable(Frame &owner, LocalInfo &info)
+{
+    if (owner.entry || info.written_by_closure)
+        return true;
+
+    if (info.param)
+        return info.assignments > 0;
+
+    return info.assignments > 1 || info.assigned_in_loop;
+}
+
+FunctionAnalysis &analysis_for(ClosureAnalysis &result, Frame *frame)
+{
+    return frame->def != nullptr ? result.functions[frame->def] : result.entry;
+}
+
+// Homes only list variables that actually leave their register.
+void drop_register_homes(FunctionAnalysis &fa)
+{
+    SymbolMap<VarHome> homes;
+    for (int i = 0; i < fa.homes.size(); i++)
+    {
+        if (fa.homes.entries[i] != HOME_REGISTER)
+            homes.insert(fa.homes.keys[i], fa.homes.entries[i]);
+    }
+
+    fa.homes = homes;
+}
+
+std::shared_ptr<ClosureAnalysis> analyze_closures(ProgramData *statement, std::vector<int> &entry_vars, SymbolMap<GlobalVar> &globals)
+{
+    AnalysisState an;
+    an.globals = &globals;
+
+    an.frames.push_back({});
+    Frame &entry = an.frames.back();
+    entry.entry = true;
+    entry.self = -1;
+
+    for (auto it = entry_vars.begin(); it != entry_vars.end(); ++it)
+    {
+        entry.locals.insert(*it, {});
+    }
+
+    collect_locals(entry, statement, 0);
+    walk_uses(an, entry, statement, USE_OTHER);
+    for (auto it = entry.children.begin(); it != entry.children.end(); ++it)
+    {
+        analyze_frame(an, **it);
+    }
+
+    std::shared_ptr<ClosureAnalysis> result = std::make_shared<ClosureAnalysis>();
+
+    for (auto it = an.frames.begin(); it != an.frames.end(); ++it)
+    {
+        FunctionAnalysis &fa = analysis_for(*result, &*it);
+        fa.kind = it->entry ? CLOSURE_PLAIN : closure_kind(*it);
+        fa.globals = it->globals;
+
+        for (auto g = it->globals.begin(); g != it->globals.end(); ++g)
+        {
+            result->entry.homes.set(*g, HOME_GLOBAL);
+        }
+    }
+
+    for (auto it = an.chains.begin(); it != an.chains.end(); ++it)
+    {
+        Frame *owner = it->owner;
+        LocalInfo &info = *owner->locals.find(it->symbol);
+
+        bool escapes = false;
+        Frame *outermost = it->inner;
+        for (Frame *f = it->inner; f != owner; f = f->parent)
+        {
+            if (analysis_for(*result, f).kind == CLOSURE_HEAP)
+                escapes = true;
+            outermost = f;
+        }
+
+        VarHome home = HOME_REGISTER;
+        if (escapes && is_mutable(*owner, info))
+            home = HOME_BOX;
+        else if (info.written_by_closure)
+            home = HOME_STACK;
+        else if (analysis_for(*result, outermost).kind == CLOSURE_STACK && is_mutable(*owner, info))
+            home = HOME_STACK;
+
+        SymbolMap<VarHome> &homes = analysis_for(*result, owner).homes;
+        VarHome *current = homes.find(it->symbol);
+        if (current == nullptr)
+            homes.insert(it->symbol, home);
+        else if (home > *current)
+            *current = home;
+    }
+
+    // Captures of a variable kept outside of registers receive its address.
+    for (auto it = an.frames.begin(); it != an.frames.end(); ++it)
+    {
+        FunctionAnalysis &fa = analysis_for(*result, &*it);
+        for (auto c = it->captures.begin(); c != it->captures.end(); ++c)
+        {
+            Frame *owner = find_owner(it->parent, *c);
+            VarHome *home = analysis_for(*result, owner).homes.find(*c);
+
+            fa.captures.push_back({*c, home != nullptr && *home != HOME_REGISTER});
+        }
+    }
+
+    for (auto it = an.frames.begin(); it != an.frames.end(); ++it)
+    {
+        drop_register_homes(analysis_for(*result, &*it));
+    }
+
+    return result;
+}
@@ -0,0 +1,251 @@
+#include <vector>
+
+// Scalar replacement of lists. A list that a function creates with
+// make_list(), only adds to, counts and indexes, and never lets go of (no
+// other use of the variable, no closure that sees it) is not allocated at
+// all: the compiled function keeps its count in a register and its
+// elements in a stack array, so add is a store and an increment and count
+// a move.
+//
+// The array needs a size, so the assignments have to run on every
+// iteration of the loop they are in (no if around them) and every add has
+// to be in that same loop. Between two assignments each add then runs at
+// most once, and the number of adds is the bound.
+
+const int scalar_list_max_slots = 16;
+
+struct ListCandidate
+{
+    bool escapes;
+
+    // Loop the assignments and adds are in; set once one is seen.
+    bool placed;
+    const ProgramData *loop;
+
+    int adds;
+};
+
+struct EscapeState
+{
+    SymbolMap<ListCandidate> lists;
+
+    // Set when make_list is a variable here.
+    bool shadowed;
+    int make_list;
+    int add;
+    int count;
+};
+
+bool is_make_list(EscapeState &es, ProgramData *node)
+{
+    if (node->type != TYPE_FUNCTION)
+        return false;
+
+    auto &vec = (*node->value.children);
+    return vec.size() == 1 && vec[0]->type == TYPE_IDENTIFIER && vec[0]->value.symbol == es.make_list;
+}
+
+// The list a call like l.add(x) or l.count() is made on, if it is a
+// candidate and the method is the given one.
+ListCandidate *list_call(EscapeState &es, ProgramData *node, int method, size_t args)
+{
+    if (node->type != TYPE_FUNCTION)
+        return nullptr;
+
+    auto &vec = (*node->value.children);
+    ProgramData *callee = vec[0].get();
+    if (vec.size() != args + 1 || callee->type != TYPE_INDEX)
+        return nullptr;
+
+    auto &index = (*callee->value.children);
+    if (index[0]->type != TYPE_IDENTIFIER || index[1]->value.symbol != method)
+        return nullptr;
+
+    return es.lists.find(index[0]->value.symbol);
+}
+
+// Assignments of make_list() to variables of this function.
+void collect_lists(EscapeState &es, ProgramData *node, const std::vector<int> &outside)
+{
+    if (node == nullptr || !has_children(node->type) || node->type == TYPE_FUNCTION_DEF)
+        return;
+
+    auto &vec = (*node->value.children);
+
+    if (node->type == TYPE_ASSIGNMENT && vec[0]->type == TYPE_IDENTIFIER)
+    {
+        int symbol = vec[0]->value.symbol;
+        if (symbol == es.make_list)
+            es.shadowed = true;
+        else if (is_make_list(es, vec[1].get()) && std::find(outside.begin(), outside.end(), symbol) == outside.end())
+            es.lists.insert(symbol, {});
+    }
+
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+        collect_lists(es, (*it).get(), outside);
+    }
+}
+
+void place_list(ListCandidate &list, const ProgramData *loop)
+{
+    if (!list.placed)
+    {
+        list.placed = true;
+        list.loop = loop;
+    }
+    else if (list.loop != loop)
+    {
+        list.escapes = true;
+    }
+}
+
+// Every use of a candidate in an expression lets it escape, except for
+// count() and l[i] in the function itself.
+void escape_uses(EscapeState &es, ProgramData *node, bool nested)
+{
+    if (node == nullptr)
+        return;
+
+    if (node->type == TYPE_IDENTIFIER)
+    {
+        if (ListCandidate *list = es.lists.find(node->value.symbol))
+            list->escapes = true;
+        return;
+    }
+
+    if (!has_children(node->type))
+        return;
+
+    if (!nested && list_call(es, node, es.count, 0) != nullptr)
+        return;
+
+    auto &vec = (*node->value.children);
+    if (node->type == TYPE_INDEX)
+    {
+        escape_uses(es, vec[0].get(), nested);
+        return;
+    }
+
+    if (!nested && node->type == TYPE_SUBSCRIPT && vec[0]->type == TYPE_IDENTIFIER &&
+        es.lists.find(vec[0]->value.symbol) != nullptr)
+    {
+        escape_uses(es, vec[1].get(), nested);
+        return;
+    }
+
+    for (size_t i = 0; i < vec.size(); i++)
+    {
+        // Field names of an object literal are not variables.
+        if (node->type == TYPE_OBJECT && i % 2 == 0)
+            continue;
+
+        escape_uses(es, vec[i].get(), nested || node->type == TYPE_FUNCTION_DEF);
+    }
+}
+
+// top is whether the statement runs on every iteration of loop (or every
+// call, outside of loops).
+void escape_statement(EscapeState &es, ProgramData *node, const ProgramData *loop, bool top)
+{
+    if (node == nullptr)
+        return;
+
+    if (!has_children(node->type))
+    {
+        escape_uses(es, node, false);
+        return;
+    }
+
+    auto &vec = (*node->value.children);
+
+    if (node->type == TYPE_ASSIGNMENT)
+    {
+        ListCandidate *list = vec[0]->type == TYPE_IDENTIFIER ? es.lists.find(vec[0]->value.symbol) : nullptr;
+        if (list != nullptr)
+        {
+            if (is_make_list(es, vec[1].get()) && top)
+                place_list(*list, loop);
+            else
+                list->escapes = true;
+        }
+        else
+        {
+            escape_uses(es, vec[0].get(), false);
+        }
+
+        escape_uses(es, vec[1].get(), false);
+        return;
+    }
+
+    // The list add returns is dropped here.
+    if (ListCandidate *list = list_call(es, node, es.add, 1))
+    {
+        place_list(*list, loop);
+        list->adds++;
+
+        escape_uses(es, vec[1].get(), false);
+        return;
+    }
+
+    if (node->type == TYPE_BLOCK)
+    {
+        for (auto it = vec.begin(); it != vec.end(); ++it)
+        {
+            escape_statement(es, (*it).get(), loop, top);
+        }
+        return;
+    }
+
+    if (node->type == TYPE_IF)
+    {
+        escape_uses(es, vec[0].get(), false);
+        escape_statement(es, vec[1].get(), loop, false);
+        escape_statement(es, vec[2].get(), loop, false);
+        return;
+    }
+
+    if (node->type == TYPE_SWITCH)
+    {
+        escape_uses(es, vec[0].get(), false);
+        escape_statement(es, vec[1].get(), loop, false);
+        for (size_t i = 3; i < vec.size(); i += 2)
+        {
+            escape_statement(es, vec[i].get(), loop, false);
+        }
+        return;
+    }
+
+    if (node->type == TYPE_WHILE)
+    {
+        escape_uses(es, vec[0].get(), false);
+        escape_statement(es, vec[1].get(), node, true);
+        return;
+    }
+
+    escape_uses(es, node, false);
+}
+
+// Lists of the function body that can be replaced, with the number of
+// element slots each needs. outside holds the parameters, captures and
+// top-level variables, which hold lists made elsewhere.
+SymbolMap<int> find_scalar_lists(ProgramData *body, const std::vector<int> &outside)
+{
+    EscapeState es = { {}, false, intern("make_list"), intern("add"), intern("count") };
+    SymbolMap<int> result;
+
+    collect_lists(es, body, outside);
+    if (es.shadowed || std::find(outside.begin(), outside.end(), es.make_list) != outside.end())
+        return result;
+
+    escape_statement(es, body, nullptr, true);
+
+    for (int i = 0; i < es.lists.size(); i++)
+    {
+        ListCandidate &list = es.lists.entries[i];
+        if (!list.escapes && list.adds <= scalar_list_max_slots)
+            result.set(es.lists.keys[i], std::max(list.adds, 1));
+    }
+
+    return result;
+}
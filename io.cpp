@@ -0,0 +1,357 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// File reads and writes for the async builtins (async.cpp). Every thread
+// gets its own io_uring, set up with the raw system calls rather than
+// liburing. Requests are only queued when they are made and go to the
+// kernel together when the thread has nothing left to run, so the tasks of
+// a script that each start a read cost one system call between them.
+//
+// Where io_uring is missing or not allowed (older kernels, seccomp
+// filters) or with --no-uring, requests go to a few I/O threads that do
+// plain pread and pwrite and hand the results back to the thread that
+// made them.
+
+struct Task;
+
+struct IoQueue;
+
+struct IoRequest
+{
+    bool write;
+    int fd;
+    struct iovec iov;
+    int64_t offset;
+
+    // Bytes transferred or -errno, once done.
+    int64_t result;
+    bool done;
+
+    // Resumed once done; nullptr when the thread's own stack waits.
+    Task *task;
+    IoQueue *owner;
+};
+
+void io_complete(IoRequest *r);
+
+const unsigned io_ring_entries = 256;
+
+struct IoRing
+{
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Queued but not yet handed to the kernel.
+    unsigned unsubmitted;
+};
+
+// Completions the I/O threads made for one thread.
+struct IoQueue
+{
+    std::mutex lock;
+    std::condition_variable ready;
+    std::vector<IoRequest *> completed;
+};
+
+struct IoContext
+{
+    bool started;
+    bool ring_ok;
+    IoRing ring;
+    IoQueue queue;
+
+    int64_t in_flight;
+};
+
+bool io_uring_disabled = false;
+thread_local IoContext io_context;
+
+int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+bool io_ring_open(IoRing &ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = io_uring_setup(io_ring_entries, &params);
+    if (ring.fd < 0)
+        return false;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_SHARED | MAP_POPULATE;
+
+    uint8_t *sq = (uint8_t *)mmap(nullptr, sq_size, prot, flags, ring.fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = single ? sq : (uint8_t *)mmap(nullptr, cq_size, prot, flags, ring.fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), prot, flags, ring.fd, IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(ring.fd);
+        return false;
+    }
+
+    ring.entries = params.sq_entries;
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.sqes = (struct io_uring_sqe *)sqes;
+
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring.unsubmitted = 0;
+    return true;
+}
+
+// Hands queued requests to the kernel, waiting for at least wait of them
+// to complete.
+bool io_ring_enter(IoRing &ring, unsigned wait)
+{
+    while (true)
+    {
+        int n = io_uring_enter(ring.fd, ring.unsubmitted, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0)
+        {
+            ring.unsubmitted -= n;
+            return true;
+        }
+
+        if (errno != EINTR && errno != EAGAIN)
+            return false;
+    }
+}
+
+// Completions the kernel has posted; how many.
+int io_ring_reap(IoContext &io)
+{
+    IoRing &ring = io.ring;
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    int count = 0;
+    for (; head != tail; head++, count++)
+    {
+        struct io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+        IoRequest *r = (IoRequest *)(uintptr_t)cqe.user_data;
+
+        r->result = cqe.res;
+        io.in_flight--;
+        io_complete(r);
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+struct IoThreads
+{
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<IoRequest *> jobs;
+};
+
+const int io_thread_count = 16;
+
+void io_thread(IoThreads *threads)
+{
+    while (true)
+    {
+        IoRequest *r;
+        {
+            std::unique_lock<std::mutex> guard(threads->lock);
+            threads->wake.wait(guard, [&] { return !threads->jobs.empty(); });
+
+            r = threads->jobs.front();
+            threads->jobs.pop_front();
+        }
+
+        ssize_t n = r->write ? pwrite(r->fd, r->iov.iov_base, r->iov.iov_len, r->offset)
+                             : pread(r->fd, r->iov.iov_base, r->iov.iov_len, r->offset);
+        r->result = n < 0 ? -errno : n;
+
+        std::lock_guard<std::mutex> guard(r->owner->lock);
+        r->owner->completed.push_back(r);
+        r->owner->ready.notify_one();
+    }
+}
+
+IoThreads *get_io_threads()
+{
+    static IoThreads *threads = nullptr;
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        threads = new IoThreads();
+        for (int i = 0; i < io_thread_count; i++)
+        {
+            std::thread(io_thread, threads).detach();
+        }
+    });
+
+    return threads;
+}
+
+IoContext &get_io()
+{
+    IoContext &io = io_context;
+    if (!io.started)
+    {
+        io.started = true;
+        io.ring_ok = !io_uring_disabled && io_ring_open(io.ring);
+    }
+
+    return io;
+}
+
+bool io_wait();
+
+void io_submit(IoRequest &r)
+{
+    IoContext &io = get_io();
+
+    r.done = false;
+    r.owner = &io.queue;
+
+    if (!io.ring_ok)
+    {
+        IoThreads *threads = get_io_threads();
+        io.in_flight++;
+
+        std::lock_guard<std::mutex> guard(threads->lock);
+        threads->jobs.push_back(&r);
+        threads->wake.notify_one();
+        return;
+    }
+
+    // The completion ring has twice the entries, so it cannot overflow as
+    // long as no more than this many are in flight.
+    IoRing &ring = io.ring;
+    while (io.in_flight >= ring.entries)
+    {
+        io_wait();
+    }
+
+    // Fewer in flight than entries, so the submission ring has room too.
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe &sqe = ring.sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+
+    sqe.opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe.fd = r.fd;
+    sqe.addr = (uint64_t)(uintptr_t)&r.iov;
+    sqe.len = 1;
+    sqe.off = r.offset;
+    sqe.user_data = (uint64_t)(uintptr_t)&r;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring.unsubmitted++;
+    io.in_flight++;
+}
+
+void io_queue_reap(IoContext &io, bool block)
+{
+    std::vector<IoRequest *> completed;
+    {
+        std::unique_lock<std::mutex> guard(io.queue.lock);
+        if (block)
+            io.queue.ready.wait(guard, [&] { return !io.queue.completed.empty(); });
+        completed.swap(io.queue.completed);
+    }
+
+    for (auto it = completed.begin(); it != completed.end(); ++it)
+    {
+        io.in_flight--;
+        io_complete(*it);
+    }
+}
+
+// Blocks until at least one request of this thread completes; false when
+// none is in flight. Requests in flight point into the stacks of whoever
+// made them, so they are waited for even when the kernel refuses to wait:
+// the ring is then polled until it takes the call again.
+bool io_wait()
+{
+    IoContext &io = get_io();
+    if (io.in_flight == 0)
+        return false;
+
+    if (!io.ring_ok)
+    {
+        io_queue_reap(io, true);
+        return true;
+    }
+
+    while (!io_ring_enter(io.ring, 1))
+    {
+        if (io_ring_reap(io) > 0)
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    io_ring_reap(io);
+    return true;
+}
+
+// Hands queued requests to the kernel and takes what has completed,
+// without blocking.
+void io_poll()
+{
+    IoContext &io = get_io();
+    if (io.in_flight == 0)
+        return;
+
+    if (!io.ring_ok)
+    {
+        io_queue_reap(io, false);
+        return;
+    }
+
+    if (io.ring.unsubmitted > 0)
+        io_ring_enter(io.ring, 0);
+    io_ring_reap(io);
+}
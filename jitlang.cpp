@@ -0,0 +1,97 @@
+// libjitlang: the compiler without its command line, see jitlang.h.
+
+#define JITLANG_LIBRARY
+#include "main.cpp"
+#include "jitlang.h"
+
+struct JitlangScript
+{
+    Program *program;
+};
+
+JitlangScript *jitlang_compile_source(SourceStream &source, std::string &error)
+{
+    BenchReport report;
+    bench_init(report, false);
+
+    Program *program = new Program();
+    bool compiled = compile_program(*program, source, std::max(1u, std::thread::hardware_concurrency()), report, error);
+    source_close(source);
+
+    if (compiled && !link_program(*program))
+    {
+        error = "COULD NOT LINK";
+        compiled = false;
+    }
+
+    if (!compiled)
+    {
+        free_program(program);
+        return nullptr;
+    }
+
+    return new JitlangScript({program});
+}
+
+JitlangScript *jitlang_compile(const char *source, size_t size, std::string &error)
+{
+    SourceStream stream;
+    source_open_memory(stream, source, size);
+
+    return jitlang_compile_source(stream, error);
+}
+
+JitlangScript *jitlang_compile_file(const char *path, std::string &error)
+{
+    SourceStream stream;
+    if (!source_open(stream, path))
+    {
+        error = "COULD NOT OPEN " + std::string(path);
+        return nullptr;
+    }
+
+    return jitlang_compile_source(stream, error);
+}
+
+void jitlang_set_memory_limit(int64_t bytes)
+{
+    mem_limit = std::max<int64_t>(0, bytes);
+}
+
+bool jitlang_run(JitlangScript *script)
+{
+    MemScope scope(MEM_OBJECTS);
+    bool ok = run_budgeted([script] { program_run(*script->program); });
+    output_flush();
+
+    if (ok)
+        script->program->ran = true;
+    return ok;
+}
+
+bool jitlang_lookup(JitlangScript *script, const char *name, JitlangFunction &function)
+{
+    return program_export(*script->program, name, function.code, function.arity) && function.arity <= jitlang_max_args;
+}
+
+bool jitlang_call(const JitlangFunction &function, const int64_t *args, int64_t &result)
+{
+    MemScope scope(MEM_OBJECTS);
+    uint64_t value = 0;
+    if (!run_budgeted([&] { value = call_function(function.code, function.arity, (const uint64_t *)args); }))
+        return false;
+
+    result = value;
+    return true;
+}
+
+void jitlang_flush()
+{
+    output_flush();
+}
+
+void jitlang_free(JitlangScript *script)
+{
+    free_program(script->program);
+    delete script;
+}
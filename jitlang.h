@@ -0,0 +1,54 @@
+#ifndef JITLANG_H
+#define JITLANG_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Embedding interface, built as libjitlang by `make libjitlang`. A script is
+// compiled once into a handle whose functions can then be called any number
+// of times. Every handle in a process shares the builtins, the types and the
+// thread pool; the code and the function slots belong to the handle.
+//
+// Values are tagged as in scripts, so numbers are passed and returned as
+// they are.
+
+struct JitlangScript;
+
+struct JitlangFunction
+{
+    void *code;
+    int arity;
+};
+
+const int jitlang_max_args = 6;
+
+// Null on failure, with the compile error in error.
+JitlangScript *jitlang_compile(const char *source, size_t size, std::string &error);
+JitlangScript *jitlang_compile_file(const char *path, std::string &error);
+
+// Budget in bytes of every compile, run and call from now on; 0 (the
+// default) for none. Only code, map tables and the parser's strings are
+// counted, since the library leaves operator new to the host.
+void jitlang_set_memory_limit(int64_t bytes);
+
+// Runs the top-level statements of the script; false when the run went
+// over its memory budget and was stopped.
+bool jitlang_run(JitlangScript *script);
+
+// Functions assigned at the top level of the script that capture nothing.
+// Fails until jitlang_run has run the top level, which assigns them.
+bool jitlang_lookup(JitlangScript *script, const char *name, JitlangFunction &function);
+
+// args holds function.arity values. False when the call went over its
+// memory budget and was stopped, with result left alone.
+bool jitlang_call(const JitlangFunction &function, const int64_t *args, int64_t &result);
+
+// Writes out what scripts printed on the calling thread.
+void jitlang_flush();
+
+// The script's functions must not be running or called again.
+void jitlang_free(JitlangScript *script);
+
+#endif
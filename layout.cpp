@@ -0,0 +1,129 @@
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Function layout. With --profile FILE every compiled function counts its
+// calls, and the counts are written to FILE at exit. --layout FILE reads
+// them back, and the linker then places functions hottest first, so the
+// code a run spends its time in shares cache lines and as few pages as
+// possible. Functions are matched between runs by a key hashed from their
+// parameters and body, which does not depend on the order the compile
+// threads handed out slots in.
+
+struct LayoutProfile
+{
+    bool counting;
+
+    // Calls per function key, read with --layout.
+    bool ordered;
+    std::unordered_map<uint64_t, uint64_t> calls;
+};
+
+LayoutProfile layout_profile;
+
+void layout_hash(uint64_t &h, const void *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        h = (h ^ ((const uint8_t *)data)[i]) * 0x100000001b3ull;
+    }
+}
+
+void layout_hash_node(uint64_t &h, ProgramData *node)
+{
+    if (node == nullptr)
+    {
+        layout_hash(h, "", 1);
+        return;
+    }
+
+    layout_hash(h, &node->type, sizeof(node->type));
+
+    if (node->type == TYPE_INTEGER)
+    {
+        layout_hash(h, &node->value.integer, sizeof(int64_t));
+    }
+    else if (node->type == TYPE_BOOLEAN)
+    {
+        layout_hash(h, &node->value.boolean, sizeof(bool));
+    }
+    else if (node->type == TYPE_STR || node->type == TYPE_STRING)
+    {
+        layout_hash(h, node->value.str, strlen(node->value.str));
+    }
+    else if (node->type == TYPE_IDENTIFIER)
+    {
+        const char *name = symbol_name(node->value.symbol);
+        layout_hash(h, name, strlen(name) + 1);
+    }
+    else
+    {
+        auto &vec = (*node->value.children);
+        for (auto it = vec.begin(); it != vec.end(); ++it)
+        {
+            layout_hash_node(h, (*it).get());
+        }
+        layout_hash(h, "", 1);
+    }
+}
+
+// Only computed when profiling or laying out, since nested functions are
+// hashed again as part of every function around them.
+uint64_t function_key(ProgramData *body, const std::vector<int> &params, int self)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    const char *name = self >= 0 ? symbol_name(self) : "";
+    layout_hash(h, name, strlen(name) + 1);
+
+    for (auto it = params.begin(); it != params.end(); ++it)
+    {
+        const char *param = symbol_name(*it);
+        layout_hash(h, param, strlen(param) + 1);
+    }
+
+    layout_hash_node(h, body);
+    return h;
+}
+
+// One "key calls" line per function, the key in hex.
+bool layout_read(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+        return false;
+
+    uint64_t key, calls;
+    while (fscanf(f, "%" SCNx64 " %" SCNu64, &key, &calls) == 2)
+    {
+        layout_profile.calls[key] += calls;
+    }
+
+    fclose(f);
+    layout_profile.ordered = true;
+    return true;
+}
+
+bool layout_write(const char *path, const std::vector<std::pair<uint64_t, uint64_t>> &counts)
+{
+    FILE *f = fopen(path, "w");
+    if (f == nullptr)
+        return false;
+
+    for (auto it = counts.begin(); it != counts.end(); ++it)
+    {
+        fprintf(f, "%016" PRIx64 " %" PRIu64 "\n", it->first, it->second);
+    }
+
+    fclose(f);
+    return true;
+}
+
+uint64_t layout_calls(uint64_t key)
+{
+    auto it = layout_profile.calls.find(key);
+    return it == layout_profile.calls.end() ? 0 : it->second;
+}
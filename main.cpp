@@ -1,4 +1,18 @@
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+
+#include <sys/mman.h>
+
 #include "parser.cpp"
+#include "bench.cpp"
+#include "source.cpp"
+#include "closure.cpp"
+#include "escape.cpp"
+#include "bounds.cpp"
+#include "arena.cpp"
+#include "layout.cpp"
 
 struct Expression
 {
@@ -6,397 +20,2404 @@ struct Expression
     Type *type;
     bool is_method;
     X86Gp object;
+
+    // Analysis of the function a function literal evaluates to.
+    const FunctionAnalysis *closure;
+
+    // Member call on a receiver of unknown type: reg is the method found at
+    // run time or 0, in which case the field named member is called.
+    bool dynamic;
+    int member;
+
+    // Type of the receiver of a method of a builtin type.
+    Type *receiver;
+
+    // The type is certain, and not what a variable held so far; with no
+    // type the value is then a number.
+    bool exact;
 };
 
+Expression exact_value(X86Gp reg, Type *type)
+{
+    Expression exp = {reg, type};
+    exp.exact = true;
+    return exp;
+}
+
+bool is_exact(const Expression &exp, Type *type)
+{
+    return exp.exact && exp.type == type;
+}
+
 typedef uint64_t (*Function)();
 
+// One function compiled into its own CodeHolder, waiting to be linked.
+struct CompiledFunction
+{
+    int slot;
+    Label entry;
+    CodeHolder code;
+    StringLogger logger;
+
+    // Profile key and call counter, see layout.cpp.
+    uint64_t key;
+    uint64_t calls;
+
+    // Where the function ended up once linked.
+    uint8_t *address;
+    size_t size;
+};
+
+// A slot of -1 is a variable that no longer holds an exported function.
+struct ExportedFunction
+{
+    int slot;
+    int arity;
+};
+
+// State shared by every function of one program while it is compiled on
+// several threads. Everything below the lock is guarded by it.
+
+struct CompileContext
+{
+    FunctionSlots slots;
+    SymbolMap<GlobalVar> globals;
+    bool log_asm;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<FunctionRemainder> queue;
+    int pending;
+    bool closed;
+    std::string error;
+    std::vector<std::unique_ptr<CompiledFunction>> functions;
+
+    // String literals longer than a small string, by text, and the field
+    // caches of the code. Both are freed with the program.
+    std::unordered_map<std::string, uint64_t> strings;
+    std::vector<FieldCache *> field_caches;
+
+    // Functions of the top level that embedders can call, by the symbol of
+    // their variable. Only the entry function writes this.
+    SymbolMap<ExportedFunction> exports;
+
+    // Module global table: the slot of every top-level variable that
+    // functions use, and the chunks holding the values.
+    SymbolMap<int> module_slots;
+    std::vector<uint64_t *> module_chunks;
+
+    // Of the compile, charged by every thread working on it.
+    MemBudget *budget;
+};
+
+// One page of slots per chunk, so slots never move once handed out.
+const int module_chunk_slots = arena_page / sizeof(uint64_t);
+
+// Slots are handed out by the entry function, before any function that
+// uses the variable is compiled. The chunks come from the code arena so
+// that code reaches them with a RIP-relative displacement.
+X86Mem module_global(CompileContext &ctx, int symbol)
+{
+    std::lock_guard<std::mutex> guard(ctx.lock);
+
+    int slot = ctx.module_slots.size();
+    if (int *existing = ctx.module_slots.find(symbol))
+    {
+        slot = *existing;
+    }
+    else
+    {
+        if (slot % module_chunk_slots == 0)
+        {
+            uint8_t *chunk = arena_alloc(code_arena, arena_page, arena_page);
+            if (chunk == nullptr)
+                throw strdup("OUT OF MEMORY FOR GLOBALS");
+
+            memset(chunk, 0, arena_page);
+            ctx.module_chunks.push_back((uint64_t *)chunk);
+        }
+
+        ctx.module_slots.insert(symbol, slot);
+    }
+
+    uint64_t *address = &ctx.module_chunks[slot / module_chunk_slots][slot % module_chunk_slots];
+    return x86::qword_ptr((uint64_t)(uintptr_t)address);
+}
+
+X86Mem int_const(X86Compiler &a, JitState &state, uint32_t scope, int64_t value)
+{
+    if (compile_stats.enabled)
+    {
+        std::lock_guard<std::mutex> guard(state.context->lock);
+        compile_stats.constants.insert({scope == kConstScopeGlobal ? -1 : state.slot, value});
+    }
+
+    return a.newInt64Const(scope, value);
+}
+
 void jit_statement(X86Compiler &a, ProgramData *statement, JitState &state);
-Expression jit_expression(X86Compiler &a, ProgramData *expression, JitState &state)
+
+// Equal literals of one program are the same string, so comparing them only
+// compares their values.
+uint64_t intern_string(JitState &state, const char *text)
 {
-    if (expression->type == TYPE_INTEGER)
+    int64_t length = strlen(text);
+    if (length <= small_string_max)
+        return make_string(text, length);
+
+    std::lock_guard<std::mutex> guard(state.context->lock);
+
+    auto it = state.context->strings.find(text);
+    if (it != state.context->strings.end())
+        return it->second;
+
+    uint64_t value = make_string(text, length);
+    state.context->strings[text] = value;
+    return value;
+}
+
+// Closures with a closure object get it as their first argument.
+bool has_env(JitState &state)
+{
+    return state.analysis->kind == CLOSURE_STACK || state.analysis->kind == CLOSURE_HEAP;
+}
+
+X86Gp call_runtime(X86Compiler &a, JitState &state, void *fn, const FuncSignature &signature, std::vector<X86Gp> args)
+{
+    X86Gp addr = a.newGpq();
+    a.mov(addr, int_const(a, state, kConstScopeGlobal, (int64_t)fn));
+
+    X86Gp ret = a.newGpq();
+    CCFuncCall *node = a.call(addr, signature);
+    for (size_t i = 0; i < args.size(); i++)
     {
-        X86Gp v_reg = a.newGpq();
-        X86Mem c0 = a.newInt64Const(kConstScopeLocal, expression->value.integer);
-        a.mov(v_reg, c0);
+        node->setArg(i, args[i]);
+    }
+    node->setRet(0, ret);
 
-        return {v_reg, nullptr};
+    return ret;
+}
+
+X86Gp read_var(X86Compiler &a, LocalVar &var)
+{
+    X86Gp v_reg = a.newGpq();
+    if (var.home == HOME_REGISTER)
+        a.mov(v_reg, var.reg);
+    else
+        a.mov(v_reg, var.mem);
+
+    return v_reg;
+}
+
+void write_var(X86Compiler &a, LocalVar &var, X86Gp value)
+{
+    if (var.home == HOME_REGISTER)
+        a.mov(var.reg, value);
+    else
+        a.mov(var.mem, value);
+}
+
+// Address a capture by pointer refers to.
+X86Gp var_address(X86Compiler &a, LocalVar &var)
+{
+    X86Gp addr = a.newGpq();
+    if (var.home == HOME_STACK)
+        a.lea(addr, var.mem);
+    else
+        a.mov(addr, var.reg);
+
+    return addr;
+}
+
+// Moves a variable to the home the closure analysis asked for, keeping its
+// value if it already has one.
+void place_var(X86Compiler &a, JitState &state, int symbol, LocalVar &var, VarHome home, bool copy)
+{
+    X86Gp value;
+    if (copy)
+        value = read_var(a, var);
+
+    if (home == HOME_STACK)
+    {
+        var.mem = a.newStack(8, 8);
+    }
+    else if (home == HOME_GLOBAL)
+    {
+        var.mem = module_global(*state.context, symbol);
+    }
+    else
+    {
+        var.reg = call_runtime(a, state, (void *)make_box, FuncSignatureT<uint64_t>(CallConv::kIdHost), {});
+        var.mem = x86::qword_ptr(var.reg);
     }
 
-    if (expression->type == TYPE_FUNCTION_DEF)
+    var.home = home;
+
+    if (copy)
+        write_var(a, var, value);
+}
+
+void place_vars(X86Compiler &a, JitState &state, const SymbolMap<VarHome> &homes)
+{
+    for (int i = 0; i < homes.size(); i++)
     {
-        auto &vec = (*expression->value.children);
+        int symbol = homes.keys[i];
+        LocalVar *var = state.vars.find(symbol);
+        if (var == nullptr)
+            place_var(a, state, symbol, state.vars.insert(symbol, {nullptr, a.newGpq()}), homes.entries[i], false);
+        else if (var->home < homes.entries[i])
+            place_var(a, state, symbol, *var, homes.entries[i], true);
+    }
+}
 
-        CCFunc* func = a.newFunc(FuncSignature0<uint64_t>(CallConv::kIdHost));
-        state.remainders.push_back({func, std::move(vec[0])});
+X86Gp capture_value(X86Compiler &a, JitState &state, const Capture &capture)
+{
+    LocalVar *var = state.vars.find(capture.symbol);
+    if (var == nullptr)
+        throw strdup(("USING " + std::string(symbol_name(capture.symbol)) + " BEFORE DEFINED").c_str());
 
-        X86Gp v_reg = a.newGpq();
-        a.lea(v_reg, x86::ptr(func->getLabel()));
+    return capture.pointer ? var_address(a, *var) : read_var(a, *var);
+}
+
+// Queues the body for compilation and evaluates to the function's address,
+// which is only known once everything has been linked, or to a closure
+// object holding that address and the captures.
+Expression jit_function_def(X86Compiler &a, ProgramData *expression, JitState &state, int self)
+{
+    auto &vec = (*expression->value.children);
+
+    std::vector<int> params;
+    for (auto it = ++vec.begin(); it != vec.end(); ++it)
+    {
+        params.push_back((*it)->value.symbol);
+    }
+
+    const FunctionAnalysis *fa = &state.closures->functions.at(expression);
+
+    uint64_t key = 0;
+    if (layout_profile.counting || layout_profile.ordered)
+        key = function_key(vec[0].get(), params, self);
+
+    int slot = new_function_slot(state.context->slots);
+    state.remainders.push_back({slot, std::move(vec[0]), params, self, state.closures, fa, key});
+
+    X86Gp addr = a.newGpq();
+    uint64_t *slot_addr = function_slot(state.context->slots, slot);
+    a.mov(addr, int_const(a, state, kConstScopeLocal, (int64_t)slot_addr));
+
+    X86Gp v_reg = a.newGpq();
+    a.mov(v_reg, x86::ptr(addr));
+
+    Type *type = get_function_type(nullptr, params.size(), nullptr);
+    if (fa->kind == CLOSURE_PLAIN || fa->kind == CLOSURE_DIRECT)
+        return {v_reg, type, false, X86Gp(), fa};
+
+    int64_t count = fa->captures.size();
+
+    X86Gp obj = a.newGpq();
+    if (fa->kind == CLOSURE_STACK)
+    {
+        a.lea(obj, a.newStack(sizeof(Closure) + count * sizeof(uint64_t), 8));
+
+        X86Gp funcs = a.newGpq();
+        a.mov(funcs, int_const(a, state, kConstScopeGlobal, (int64_t)&closure_type->functions.func));
+
+        a.mov(x86::dword_ptr(obj, offsetof(Obj, type)), closure_type_number);
+        a.mov(x86::qword_ptr(obj, offsetof(Obj, funcs)), funcs);
+        a.mov(x86::qword_ptr(obj, closure_code_offset), v_reg);
+        a.mov(x86::qword_ptr(obj, closure_count_offset), count);
+    }
+    else
+    {
+        X86Gp n = a.newGpq();
+        a.mov(n, count);
+
+        obj = call_runtime(a, state, (void *)make_closure, FuncSignatureT<uint64_t, uint64_t, int64_t>(CallConv::kIdHost), {v_reg, n});
+    }
+
+    for (int64_t i = 0; i < count; i++)
+    {
+        X86Gp value = capture_value(a, state, fa->captures[i]);
+        a.mov(x86::qword_ptr(obj, closure_captures_offset + i * sizeof(uint64_t)), value);
+    }
+
+    X86Gp closure = a.newGpq();
+    a.mov(closure, obj);
+    a.or_(closure, int_const(a, state, kConstScopeGlobal, NUM_BIT));
+
+    return {closure, type, false, X86Gp(), fa};
+}
+
+CCFuncCall *emit_call(X86Compiler &a, X86Gp func, const FuncSignature *signature, std::vector<X86Gp> &args, X86Gp ret)
+{
+    FuncSignatureX generic(CallConv::kIdHost);
+    if (signature == nullptr)
+    {
+        generic.setRetT<uint64_t>();
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            generic.addArgT<uint64_t>();
+        }
+
+        signature = &generic;
+    }
+
+    CCFuncCall *node = a.call(func, *signature);
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        node->setArg(i, args[i]);
+    }
+    node->setRet(0, ret);
+
+    return node;
+}
+
+// A script function value is either a code address or a closure object,
+// whose code takes the closure as an extra first argument.
+void emit_dynamic_call(X86Compiler &a, JitState &state, X86Gp func, std::vector<X86Gp> &args, X86Gp ret)
+{
+    Label plain = a.newLabel();
+    Label done = a.newLabel();
+
+    a.bt(func, 62);
+    a.jnc(plain);
+
+    X86Gp code = a.newGpq();
+    a.mov(code, func);
+    a.and_(code, int_const(a, state, kConstScopeGlobal, ~NUM_BIT));
+    a.mov(code, x86::qword_ptr(code, closure_code_offset));
+
+    std::vector<X86Gp> closure_args;
+    closure_args.push_back(func);
+    closure_args.insert(closure_args.end(), args.begin(), args.end());
+
+    emit_call(a, code, nullptr, closure_args, ret);
+    a.jmp(done);
+
+    a.bind(plain);
+    emit_call(a, func, nullptr, args, ret);
+
+    a.bind(done);
+}
+
+X86Gp load_const(X86Compiler &a, JitState &state, int64_t value)
+{
+    X86Gp reg = a.newGpq();
+    a.mov(reg, int_const(a, state, kConstScopeLocal, value));
+
+    return reg;
+}
+
+// Untags value into obj, going to miss unless it is an object of type t:
+// the top three bits have to be 010, since negative numbers can have bit
+// 62 set too.
+void emit_type_guard(X86Compiler &a, X86Gp value, X86Gp obj, Type *t, Label miss)
+{
+    a.mov(obj, value);
+    a.btr(obj, 62);
+    a.jnc(miss);
+    a.bt(obj, 61);
+    a.jc(miss);
+    a.bt(obj, 63);
+    a.jc(miss);
+
+    a.cmp(x86::dword_ptr(obj, offsetof(Obj, type)), t->type_number);
+    a.jne(miss);
+}
+
+// Same for whatever type the site's cache holds; returns the offset of the
+// field in that type.
+X86Gp emit_cache_guard(X86Compiler &a, JitState &state, X86Gp value, X86Gp obj, FieldCache *cache, Label miss)
+{
+    a.mov(obj, value);
+    a.btr(obj, 62);
+    a.jnc(miss);
+    a.bt(obj, 61);
+    a.jc(miss);
+    a.bt(obj, 63);
+    a.jc(miss);
+
+    X86Gp entry = load_const(a, state, (int64_t)cache);
+    a.mov(entry, x86::qword_ptr(entry));
+    a.cmp(x86::dword_ptr(obj, offsetof(Obj, type)), entry.r32());
+    a.jne(miss);
+
+    a.shr(entry, 32);
+    return entry;
+}
+
+X86Mem field_mem(X86Compiler &a, X86Gp obj, int index)
+{
+    if (index < object_inline_slots)
+        return x86::qword_ptr(obj, object_slots_offset + index * sizeof(uint64_t));
+
+    X86Gp overflow = a.newGpq();
+    a.mov(overflow, x86::qword_ptr(obj, object_overflow_offset));
+
+    return x86::qword_ptr(overflow, (index - object_inline_slots) * sizeof(uint64_t));
+}
+
+// Caches belong to the compiled code and live as long as the program.
+FieldCache *new_field_cache(JitState &state)
+{
+    FieldCache *cache = new FieldCache();
+    cache->entry = field_cache_empty;
+
+    std::lock_guard<std::mutex> guard(state.context->lock);
+    state.context->field_caches.push_back(cache);
+    return cache;
+}
+
+// Field read. With a known layout it is a type check and one load at a
+// constant offset; otherwise the offset comes from the site's cache. Both
+// fall back to object_get.
+X86Gp jit_field_get(X86Compiler &a, JitState &state, Expression &exp, int field)
+{
+    X86Gp v_reg = a.newGpq();
+    X86Gp obj = a.newGpq();
+    Label miss = a.newLabel();
+    Label done = a.newLabel();
+
+    Type *t = exp.type;
+    int *index = t != nullptr && t->object ? t->fields.find(field) : nullptr;
+    FieldCache *cache = nullptr;
+
+    if (index != nullptr)
+    {
+        emit_type_guard(a, exp.reg, obj, t, miss);
+        a.mov(v_reg, field_mem(a, obj, *index));
+    }
+    else
+    {
+        cache = new_field_cache(state);
+        X86Gp offset = emit_cache_guard(a, state, exp.reg, obj, cache, miss);
+        a.mov(v_reg, x86::qword_ptr(obj, offset));
+    }
+    a.jmp(done);
+
+    a.bind(miss);
+    X86Gp slow = call_runtime(a, state, (void *)object_get, FuncSignatureT<uint64_t, uint64_t, int64_t, uint64_t>(CallConv::kIdHost),
+                              {exp.reg, load_const(a, state, field), load_const(a, state, (int64_t)cache)});
+    a.mov(v_reg, slow);
+
+    a.bind(done);
+    return v_reg;
+}
+
+// Field write. Adding a field to an object of known layout is a store and
+// a change of Obj::type, as long as the field fits in the object; receiver
+// is then known to have the new layout.
+void jit_field_set(X86Compiler &a, JitState &state, Expression &exp, int field, X86Gp value, ProgramData *receiver)
+{
+    X86Gp obj = a.newGpq();
+    Label miss = a.newLabel();
+    Label done = a.newLabel();
+
+    Type *t = exp.type;
+    int *index = t != nullptr && t->object ? t->fields.find(field) : nullptr;
+    FieldCache *cache = nullptr;
+
+    if (index != nullptr)
+    {
+        emit_type_guard(a, exp.reg, obj, t, miss);
+        a.mov(field_mem(a, obj, *index), value);
+    }
+    else if (t != nullptr && t->object && t->fields.size() < object_inline_slots)
+    {
+        Type *next = object_transition(t, field);
+
+        emit_type_guard(a, exp.reg, obj, t, miss);
+        a.mov(field_mem(a, obj, t->fields.size()), value);
+        a.mov(x86::dword_ptr(obj, offsetof(Obj, type)), next->type_number);
+
+        if (receiver->type == TYPE_IDENTIFIER)
+        {
+            if (LocalVar *var = state.vars.find(receiver->value.symbol))
+                var->type = next;
+        }
+    }
+    else
+    {
+        cache = new_field_cache(state);
+        X86Gp offset = emit_cache_guard(a, state, exp.reg, obj, cache, miss);
+        a.mov(x86::qword_ptr(obj, offset), value);
+    }
+    a.jmp(done);
+
+    a.bind(miss);
+    call_runtime(a, state, (void *)object_set, FuncSignatureT<uint64_t, uint64_t, int64_t, uint64_t, uint64_t>(CallConv::kIdHost),
+                 {exp.reg, load_const(a, state, field), value, load_const(a, state, (int64_t)cache)});
+
+    a.bind(done);
+}
+
+Expression jit_expression(X86Compiler &a, ProgramData *expression, JitState &state);
+
+X86Xmm broadcast_byte(X86Compiler &a, JitState &state, X86Gp byte)
+{
+    X86Gp bytes = a.newGpq();
+    a.mov(bytes, byte);
+    a.imul(bytes, int_const(a, state, kConstScopeGlobal, 0x0101010101010101ll));
+
+    X86Xmm v = a.newXmm();
+    a.movq(v, bytes);
+    a.pshufd(v, v, 0x44);
+
+    return v;
+}
+
+// map.get(key) and map.has(key) on integer keys look at the first group of
+// the key's probe sequence inline; other keys, other types and lookups that
+// have to continue to the next group call the native.
+void emit_map_lookup(X86Compiler &a, JitState &state, Expression &exp, std::vector<X86Gp> &args, X86Gp ret, bool has, Label miss)
+{
+    X86Gp key = args[1];
+    X86Gp obj = a.newGpq();
+    Label slow = a.newLabel();
+    Label next = a.newLabel();
+    Label found = a.newLabel();
+    Label missing = a.newLabel();
+    Label done = a.newLabel();
+
+    emit_type_guard(a, args[0], obj, map_type, miss);
+    a.bt(key, 62);
+    a.jc(slow);
+
+    // Same hash as map_hash.
+    X86Gp hash = a.newGpq();
+    X86Gp high = a.newGpq();
+    a.mov(hash, key);
+    a.imul(hash, int_const(a, state, kConstScopeGlobal, (int64_t)map_hash_multiplier));
+    a.mov(high, hash);
+    a.shr(high, 32);
+    a.xor_(hash, high);
+
+    X86Gp h2 = a.newGpq();
+    a.mov(h2, hash);
+    a.and_(h2, 0x7f);
+    X86Xmm match = broadcast_byte(a, state, h2);
+
+    // Index of the group's first slot.
+    X86Gp first = a.newGpq();
+    a.mov(first, hash);
+    a.shr(first, 7);
+    a.and_(first, x86::qword_ptr(obj, map_group_mask_offset));
+    a.shl(first, 4);
+
+    X86Gp ctrl = a.newGpq();
+    X86Xmm group = a.newXmm();
+    a.mov(ctrl, x86::qword_ptr(obj, map_ctrl_offset));
+    a.movdqa(group, x86::xmmword_ptr(ctrl, first));
+
+    X86Xmm eq = a.newXmm();
+    X86Gp bits = a.newGpq();
+    a.movdqa(eq, group);
+    a.pcmpeqb(eq, match);
+    a.pmovmskb(bits.r32(), eq);
+
+    X86Gp slots = a.newGpq();
+    X86Gp offset = a.newGpq();
+    X86Gp rest = a.newGpq();
+    a.mov(slots, x86::qword_ptr(obj, map_slots_offset));
+
+    a.bind(next);
+    a.test(bits, bits);
+    a.jz(missing);
+
+    a.bsf(offset, bits);
+    a.add(offset, first);
+    a.shl(offset, 4);
+    a.cmp(x86::qword_ptr(slots, offset), key);
+    a.je(found);
+
+    a.lea(rest, x86::ptr(bits, -1));
+    a.and_(bits, rest);
+    a.jmp(next);
+
+    a.bind(found);
+    if (has)
+        a.mov(ret, 1);
+    else
+        a.mov(ret, x86::qword_ptr(slots, offset, 0, 8));
+    a.jmp(done);
+
+    // The key is missing if the group has an empty slot.
+    a.bind(missing);
+    X86Gp empty_byte = a.newGpq();
+    a.mov(empty_byte, 0x80);
+    X86Xmm empty = broadcast_byte(a, state, empty_byte);
+    a.pcmpeqb(empty, group);
+    a.pmovmskb(bits.r32(), empty);
+    a.test(bits, bits);
+    a.jz(slow);
+
+    a.mov(ret, 0);
+    a.jmp(done);
+
+    a.bind(slow);
+    emit_call(a, exp.reg, exp.type->signature, args, ret);
+
+    a.bind(done);
+}
+
+// Calls the method found at run time, or else the field of that name.
+void emit_member_call(X86Compiler &a, JitState &state, Expression &exp, std::vector<X86Gp> &args, X86Gp ret);
+
+// Same as emit_type_guard, except that small strings pass for strings.
+void emit_receiver_guard(X86Compiler &a, X86Gp value, X86Gp obj, Type *t, Label miss)
+{
+    Label ok = a.newLabel();
+    if (t == string_type)
+    {
+        a.mov(obj, value);
+        a.shr(obj, 61);
+        a.cmp(obj, 3);
+        a.je(ok);
+    }
+
+    emit_type_guard(a, value, obj, t, miss);
+    a.bind(ok);
+}
+
+// A method of a builtin type, called directly while the receiver has the
+// type the compiler expects and looked up at run time when it does not.
+void emit_method_call(X86Compiler &a, JitState &state, Expression &exp, std::vector<X86Gp> &args, X86Gp ret)
+{
+    static const int get_symbol = intern("get");
+    static const int has_symbol = intern("has");
+
+    Label miss = a.newLabel();
+    Label done = a.newLabel();
+
+    if (exp.receiver == map_type && (exp.member == get_symbol || exp.member == has_symbol))
+    {
+        emit_map_lookup(a, state, exp, args, ret, exp.member == has_symbol, miss);
+    }
+    else
+    {
+        X86Gp obj = a.newGpq();
+        emit_receiver_guard(a, args[0], obj, exp.receiver, miss);
+        emit_call(a, exp.reg, exp.type->signature, args, ret);
+    }
+    a.jmp(done);
+
+    a.bind(miss);
+    X86Gp method = call_runtime(a, state, (void *)lookup_method, FuncSignatureT<uint64_t, uint64_t, int64_t>(CallConv::kIdHost),
+                                {args[0], load_const(a, state, exp.member)});
+
+    Expression found = {method, nullptr, true, args[0]};
+    found.dynamic = true;
+    found.member = exp.member;
+    emit_member_call(a, state, found, args, ret);
+
+    a.bind(done);
+}
+
+void emit_member_call(X86Compiler &a, JitState &state, Expression &exp, std::vector<X86Gp> &args, X86Gp ret)
+{
+    Label field = a.newLabel();
+    Label done = a.newLabel();
+
+    a.test(exp.reg, exp.reg);
+    a.jz(field);
+
+    emit_call(a, exp.reg, nullptr, args, ret);
+    a.jmp(done);
+
+    a.bind(field);
+    Expression receiver = {exp.object, nullptr};
+    X86Gp func = jit_field_get(a, state, receiver, exp.member);
+
+    std::vector<X86Gp> rest(args.begin() + 1, args.end());
+    emit_dynamic_call(a, state, func, rest, ret);
+
+    a.bind(done);
+}
+
+// p.x reads a field unless p is of a builtin type, whose methods are
+// called directly. When the receiver's type is not known and the member is
+// called, the method is looked up at run time.
+Expression jit_index(X86Compiler &a, ProgramData *expression, JitState &state, bool call)
+{
+    auto &vec = (*expression->value.children);
+    Expression exp = jit_expression(a, vec[0].get(), state);
+
+    Type *t = exp.type;
+    int property = vec[1]->value.symbol;
+
+    if (t == nullptr && call)
+    {
+        X86Gp method = call_runtime(a, state, (void *)lookup_method, FuncSignatureT<uint64_t, uint64_t, int64_t>(CallConv::kIdHost),
+                                    {exp.reg, load_const(a, state, property)});
+
+        Expression result = {method, nullptr, true, exp.reg};
+        result.dynamic = true;
+        result.member = property;
+        return result;
+    }
+
+    if (t == nullptr || t->object)
+        return {jit_field_get(a, state, exp, property), nullptr};
+
+    int *method = t->function_lookup.find(property);
+    if (method == nullptr)
+        throw strdup(("TYPE DOES NOT HAVE " + std::string(symbol_name(property))).c_str());
+
+    int function_number = *method;
+
+    // The receiver's type is expected to be t, so the method is called
+    // directly, behind a guard (see emit_method_call).
+    X86Gp obj = a.newGpq("Index");
+    X86Mem c0 = int_const(a, state, kConstScopeLocal, (int64_t)funcToValue(t->functions.func[function_number]));
+    a.mov(obj, c0);
+
+    Expression result = {obj, t->functions.type[function_number], t->functions.is_method[function_number], exp.reg};
+    result.member = property;
+    result.receiver = t;
+    return result;
+}
+
+// A list kept in the frame (see escape.cpp) that callee is a method of.
+LocalVar *scalar_list(JitState &state, ProgramData *callee)
+{
+    if (callee->type != TYPE_INDEX)
+        return nullptr;
+
+    ProgramData *receiver = (*callee->value.children)[0].get();
+    if (receiver->type != TYPE_IDENTIFIER)
+        return nullptr;
+
+    LocalVar *var = state.vars.find(receiver->value.symbol);
+    return var != nullptr && var->list_slots > 0 ? var : nullptr;
+}
+
+// The escape analysis only lets add and count through.
+Expression jit_scalar_list_call(X86Compiler &a, ProgramData *expression, JitState &state, LocalVar &list)
+{
+    static const int add_symbol = intern("add");
+
+    auto &vec = (*expression->value.children);
+    int method = (*vec[0]->value.children)[1]->value.symbol;
+
+    if (method == add_symbol)
+    {
+        X86Gp value = jit_expression(a, vec[1].get(), state).reg;
+
+        X86Mem element = list.mem;
+        element.setIndex(list.reg, 3);
+        a.mov(element, value);
+        a.inc(list.reg);
+
+        return {value, nullptr};
+    }
+
+    X86Gp count = a.newGpq();
+    a.mov(count, list.reg);
+
+    return {count, nullptr};
+}
+
+// A list kept in the frame that a subscript is applied to.
+LocalVar *scalar_subscript(JitState &state, ProgramData *receiver)
+{
+    if (receiver->type != TYPE_IDENTIFIER)
+        return nullptr;
+
+    LocalVar *var = state.vars.find(receiver->value.symbol);
+    return var != nullptr && var->list_slots > 0 ? var : nullptr;
+}
+
+// Whether l[i] is inside a counted loop over l with index i.
+bool in_bounds(JitState &state, ProgramData *subscript)
+{
+    auto &vec = (*subscript->value.children);
+    if (vec[0]->type != TYPE_IDENTIFIER || vec[1]->type != TYPE_IDENTIFIER)
+        return false;
+
+    auto key = std::make_pair(vec[0]->value.symbol, vec[1]->value.symbol);
+    return std::find(state.bounded.begin(), state.bounded.end(), key) != state.bounded.end();
+}
+
+// Element l[i] refers to, given the evaluated list (unless it is kept in
+// the frame) and index. Goes to miss when the value is not a list or the
+// index is out of range; the unsigned compare catches negative indices.
+X86Mem element_mem(X86Compiler &a, ProgramData *subscript, JitState &state, X86Gp value, X86Gp index, Label miss)
+{
+    bool check = !in_bounds(state, subscript);
+
+    if (LocalVar *list = scalar_subscript(state, (*subscript->value.children)[0].get()))
+    {
+        if (check)
+        {
+            a.cmp(index, list->reg);
+            a.jae(miss);
+        }
+
+        X86Mem element = list->mem;
+        element.setIndex(index, 3);
+        return element;
+    }
+
+    X86Gp obj = a.newGpq();
+    emit_type_guard(a, value, obj, list_type, miss);
+
+    if (check)
+    {
+        X86Gp size = a.newGpq();
+        a.mov(size.r32(), x86::dword_ptr(obj, list_size_offset));
+        a.cmp(index, size);
+        a.jae(miss);
+    }
+
+    X86Gp elements = a.newGpq();
+    a.mov(elements, x86::qword_ptr(obj, list_elements_offset));
+
+    return x86::qword_ptr(elements, index, 3);
+}
+
+// Receiver and index of l[i], in that order.
+X86Gp jit_subscript_operands(X86Compiler &a, ProgramData *subscript, JitState &state, X86Gp &index)
+{
+    auto &vec = (*subscript->value.children);
+
+    X86Gp value;
+    if (scalar_subscript(state, vec[0].get()) == nullptr)
+        value = jit_expression(a, vec[0].get(), state).reg;
+
+    index = jit_expression(a, vec[1].get(), state).reg;
+    return value;
+}
+
+// Out of range reads and reads of non-lists give 0.
+Expression jit_subscript(X86Compiler &a, ProgramData *subscript, JitState &state)
+{
+    X86Gp index;
+    X86Gp value = jit_subscript_operands(a, subscript, state, index);
+
+    X86Gp ret = a.newGpq();
+    Label miss = a.newLabel();
+    Label done = a.newLabel();
+
+    a.mov(ret, element_mem(a, subscript, state, value, index, miss));
+    a.jmp(done);
+
+    a.bind(miss);
+    a.mov(ret, 0);
+
+    a.bind(done);
+    return {ret, nullptr};
+}
+
+// Goes to maybe when the value is an object or a small string, whose top two
+// bits are 01; numbers have 00 or 11 there.
+void emit_string_check(X86Compiler &a, X86Gp value, Label maybe)
+{
+    X86Gp top = a.newGpq();
+    a.mov(top, value);
+    a.shr(top, 62);
+    a.cmp(top, 1);
+    a.je(maybe);
+}
+
+// Interned literals and small strings are equal exactly when their values
+// are, so only two different heap strings get compared by text. Unless one
+// side is known to be a string, that is first checked from their tags.
+X86Gp emit_string_equal(X86Compiler &a, JitState &state, X86Gp reg_a, X86Gp reg_b, bool equality, bool known)
+{
+    X86Gp result = a.newGpq();
+    Label done = a.newLabel();
+
+    a.mov(result, 1);
+    a.cmp(reg_a, reg_b);
+    a.je(done);
+
+    if (!known)
+    {
+        X86Gp top = a.newGpq();
+        a.mov(result, 0);
+        a.mov(top, reg_a);
+        a.shr(top, 61);
+        a.cmp(top, 2);
+        a.jne(done);
+        a.mov(top, reg_b);
+        a.shr(top, 61);
+        a.cmp(top, 2);
+        a.jne(done);
+    }
+
+    X86Gp equal = call_runtime(a, state, (void *)NATIVE(string_equal)::address(), *NATIVE(string_equal)::signature(), {reg_a, reg_b});
+    a.mov(result, equal);
+
+    a.bind(done);
+    if (!equality)
+        a.xor_(result, 1);
+
+    return result;
+}
+
+Expression jit_expression(X86Compiler &a, ProgramData *expression, JitState &state)
+{
+    if (expression->type == TYPE_INTEGER)
+    {
+        X86Gp v_reg = a.newGpq();
+        X86Mem c0 = int_const(a, state, kConstScopeLocal, expression->value.integer);
+        a.mov(v_reg, c0);
+
+        return exact_value(v_reg, nullptr);
+    }
+
+    if (expression->type == TYPE_STRING)
+    {
+        X86Gp v_reg = a.newGpq();
+        X86Mem c0 = int_const(a, state, kConstScopeGlobal, intern_string(state, expression->value.str));
+        a.mov(v_reg, c0);
+
+        return exact_value(v_reg, string_type);
+    }
+
+    if (expression->type == TYPE_FUNCTION_DEF)
+    {
+        return jit_function_def(a, expression, state, -1);
+    }
+
+    if (expression->type == TYPE_INDEX)
+    {
+        return jit_index(a, expression, state, false);
+    }
+
+    if (expression->type == TYPE_SUBSCRIPT)
+    {
+        return jit_subscript(a, expression, state);
+    }
+
+    if (expression->type == TYPE_OBJECT)
+    {
+        auto &vec = (*expression->value.children);
+
+        std::vector<int> fields;
+        std::vector<X86Gp> values;
+        for (size_t i = 0; i < vec.size(); i += 2)
+        {
+            fields.push_back(vec[i]->value.symbol);
+            values.push_back(jit_expression(a, vec[i + 1].get(), state).reg);
+        }
+
+        // The layout of a literal is known here, so the fields are stored
+        // at constant offsets.
+        Type *t = object_layout(fields);
+        X86Gp obj = call_runtime(a, state, (void *)make_object, FuncSignatureT<uint64_t, uint64_t>(CallConv::kIdHost), {load_const(a, state, (int64_t)t)});
+
+        for (size_t i = 0; i < fields.size(); i++)
+        {
+            a.mov(field_mem(a, obj, *t->fields.find(fields[i])), values[i]);
+        }
+
+        X86Gp v_reg = a.newGpq();
+        a.mov(v_reg, obj);
+        a.or_(v_reg, int_const(a, state, kConstScopeGlobal, NUM_BIT));
+
+        return {v_reg, t, false};
+    }
+
+    if (expression->type == TYPE_IDENTIFIER)
+    {
+        int symbol = expression->value.symbol;
+
+        if (LocalVar *var = state.vars.find(symbol))
+        {
+            return {read_var(a, *var), var->type, false};
+        }
+        else if (symbol == state.self)
+        {
+            X86Gp v_reg = a.newGpq();
+            if (has_env(state))
+                a.mov(v_reg, state.env);
+            else
+                a.lea(v_reg, x86::ptr(state.entry));
+
+            return {v_reg, get_function_type(nullptr, state.params.size(), nullptr), false};
+        }
+        else if (GlobalVar *var = state.globals.find(symbol))
+        {
+            X86Gp v_reg = a.newGpq();
+            X86Mem c0 = int_const(a, state, kConstScopeGlobal, var->value);
+            a.mov(v_reg, c0);
+
+            return {v_reg, var->type, false};
+        }
+        else
+        {
+            throw strdup(("USING " + std::string(symbol_name(symbol)) + " BEFORE DEFINED").c_str());
+        }
+    }
+
+    if (expression->type == TYPE_FUNCTION)
+    {
+        auto &vec = (*expression->value.children);
+        ProgramData *callee = vec[0].get();
+
+        if (LocalVar *list = scalar_list(state, callee))
+            return jit_scalar_list_call(a, expression, state, *list);
+
+        Expression exp = callee->type == TYPE_INDEX ? jit_index(a, callee, state, true) : jit_expression(a, callee, state);
+        X86Gp func = exp.reg;
+        Type *type = exp.type;
+
+        std::vector<X86Gp> args;
+        if (exp.is_method)
+            args.push_back(exp.object);
+
+        for (auto it = ++vec.begin(); it != vec.end(); ++it)
+        {
+            args.push_back(jit_expression(a, (*it).get(), state).reg);
+        }
+
+        int arg_count = args.size();
+        if (type != nullptr && type->arity >= 0 && type->arity != arg_count)
+            throw strdup(("EXPECTED " + std::to_string(type->arity) + " ARGUMENTS, GOT " + std::to_string(arg_count)).c_str());
+
+        // Functions that are only ever called by name get their captures
+        // as extra arguments, so they need no closure object.
+        const FunctionAnalysis *direct = nullptr;
+        bool is_self = false;
+        if (callee->type == TYPE_IDENTIFIER)
+        {
+            int symbol = callee->value.symbol;
+            if (LocalVar *var = state.vars.find(symbol))
+                direct = var->direct;
+            else if (symbol == state.self && !has_env(state))
+                is_self = true;
+
+            if (is_self && state.analysis->kind == CLOSURE_DIRECT)
+                direct = state.analysis;
+        }
+
+        if (direct != nullptr)
+        {
+            for (auto it = direct->captures.begin(); it != direct->captures.end(); ++it)
+            {
+                args.push_back(capture_value(a, state, *it));
+            }
+        }
+
+        X86Gp ret = a.newGpq();
+        if (exp.receiver != nullptr && exp.is_method)
+            emit_method_call(a, state, exp, args, ret);
+        else if (type != nullptr && type->signature != nullptr)
+            emit_call(a, func, type->signature, args, ret);
+        else if (exp.dynamic)
+            emit_member_call(a, state, exp, args, ret);
+        else if (exp.is_method || direct != nullptr || is_self)
+            emit_call(a, func, nullptr, args, ret);
+        else
+            emit_dynamic_call(a, state, func, args, ret);
+
+        return {ret, type != nullptr ? type->return_type : nullptr};
+    }
+
+    if (expression->type == TYPE_SUB)
+    {
+        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
+        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+
+        a.sub(reg_a, reg_b);
+
+        return exact_value(reg_a, nullptr);
+    }
+
+    if (expression->type == TYPE_ADD)
+    {
+        Expression exp_a = jit_expression(a, (*expression->value.children)[0].get(), state);
+        Expression exp_b = jit_expression(a, (*expression->value.children)[1].get(), state);
+        X86Gp reg_a = exp_a.reg;
+        X86Gp reg_b = exp_b.reg;
+
+        if (is_exact(exp_a, string_type) || is_exact(exp_b, string_type))
+        {
+            X86Gp v_reg = call_runtime(a, state, (void *)NATIVE(string_concat)::address(), *NATIVE(string_concat)::signature(), {reg_a, reg_b});
+            return exact_value(v_reg, string_type);
+        }
+
+        bool number_a = is_exact(exp_a, nullptr);
+        bool number_b = is_exact(exp_b, nullptr);
+        if (number_a && number_b)
+        {
+            a.add(reg_a, reg_b);
+            return exact_value(reg_a, nullptr);
+        }
+
+        // Either side may be a string whatever its variable held so far.
+        Label slow = a.newLabel();
+        Label done = a.newLabel();
+        X86Gp v_reg = a.newGpq();
+
+        if (!number_a)
+            emit_string_check(a, reg_a, slow);
+        if (!number_b)
+            emit_string_check(a, reg_b, slow);
+
+        a.mov(v_reg, reg_a);
+        a.add(v_reg, reg_b);
+        a.jmp(done);
+
+        a.bind(slow);
+        X86Gp sum = call_runtime(a, state, (void *)value_add, FuncSignatureT<uint64_t, uint64_t, uint64_t>(CallConv::kIdHost), {reg_a, reg_b});
+        a.mov(v_reg, sum);
+
+        a.bind(done);
+        return {v_reg, nullptr};
+    }
+
+    if (expression->type == TYPE_MULT)
+    {
+        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
+        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+
+        a.imul(reg_a, reg_b);
+
+        return exact_value(reg_a, nullptr);
+    }
+
+    if (expression->type == TYPE_DIV)
+    {
+        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
+        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+        X86Gp reg_c = a.newGpq();
+
+        a.mov(reg_c, 0);
+        a.idiv(reg_c, reg_a, reg_b);
+
+        return exact_value(reg_a, nullptr);
+    }
+
+    if (expression->type == TYPE_EQUALITY || expression->type == TYPE_NOTEQUALITY)
+    {
+        Expression exp_a = jit_expression(a, (*expression->value.children)[0].get(), state);
+        Expression exp_b = jit_expression(a, (*expression->value.children)[1].get(), state);
+        X86Gp reg_a = exp_a.reg;
+        X86Gp reg_b = exp_b.reg;
+        bool equality = expression->type == TYPE_EQUALITY;
+
+        // Equal texts can only hide behind different bits when neither
+        // side is known to be a number.
+        bool known = is_exact(exp_a, string_type) || is_exact(exp_b, string_type);
+        if (known || (!is_exact(exp_a, nullptr) && !is_exact(exp_b, nullptr)))
+            return exact_value(emit_string_equal(a, state, reg_a, reg_b, equality, known), nullptr);
+
+        a.cmp(reg_a, reg_b);
+        if (equality)
+            a.sete(reg_a.r8());
+        else
+            a.setne(reg_a.r8());
+        a.movzx(reg_a, reg_a.r8());
+
+        return exact_value(reg_a, nullptr);
+    }
+
+    if (expression->type == TYPE_LT)
+    {
+        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
+        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+
+        a.cmp(reg_a, reg_b);
+        a.setl(reg_a.r8());
+        a.movzx(reg_a, reg_a.r8());
+
+        return exact_value(reg_a, nullptr);
+    }
+
+    throw strdup(("UNKOWN EXPRESSION " + std::to_string(expression->type)).c_str());
+}
+
+// A call of the function being compiled, by its own name, with one
+// argument per parameter.
+bool is_self_tail_call(ProgramData *value, JitState &state)
+{
+    if (value->type != TYPE_FUNCTION || state.self < 0)
+        return false;
+
+    auto &vec = (*value->value.children);
+    ProgramData *callee = vec[0].get();
+
+    return callee->type == TYPE_IDENTIFIER && callee->value.symbol == state.self &&
+           state.vars.find(state.self) == nullptr && vec.size() - 1 == state.params.size();
+}
+
+bool is_register_var(JitState &state, int symbol)
+{
+    LocalVar *var = state.vars.find(symbol);
+    return var != nullptr && var->home == HOME_REGISTER;
+}
+
+// Switches with at most this many cases compare them one by one, and so
+// do the leaves of a decision tree.
+const size_t switch_chain_max = 4;
+
+// Cases spanning at most this many values per case, and at most
+// switch_table_max values, get a jump table.
+const int64_t switch_table_spread = 3;
+const int64_t switch_table_max = 4096;
+
+struct SwitchCase
+{
+    int64_t value;
+    Label label;
+};
+
+void jit_case_chain(X86Compiler &a, X86Gp value, const std::vector<SwitchCase> &cases, size_t from, size_t to, Label otherwise)
+{
+    for (size_t i = from; i < to; i++)
+    {
+        a.cmp(value, cases[i].value);
+        a.je(cases[i].label);
+    }
+
+    a.jmp(otherwise);
+}
+
+// Binary search over the sorted cases.
+void jit_case_tree(X86Compiler &a, X86Gp value, const std::vector<SwitchCase> &cases, size_t from, size_t to, Label otherwise)
+{
+    if (to - from <= switch_chain_max)
+    {
+        jit_case_chain(a, value, cases, from, to, otherwise);
+        return;
+    }
+
+    size_t mid = from + (to - from) / 2;
+    Label above = a.newLabel();
+
+    a.cmp(value, cases[mid].value);
+    a.je(cases[mid].label);
+    a.jg(above);
+
+    jit_case_tree(a, value, cases, from, mid, otherwise);
+    a.bind(above);
+    jit_case_tree(a, value, cases, mid + 1, to, otherwise);
+}
+
+// The register allocator does not follow indirect jumps, and this version
+// of asmjit has no way to tell it where one goes, so the table jump is
+// paired with a branch that is never taken to one conditional jump per
+// case. The allocator sees every case reached from that one point with
+// nothing allocated in between, which is also the state the table jump
+// leaves them in. Nothing is compared there, so value is not kept alive
+// past the jump.
+void jit_case_table(X86Compiler &a, X86Gp value, const std::vector<SwitchCase> &cases, Label otherwise)
+{
+    int64_t low = cases.front().value;
+    int64_t range = cases.back().value - low + 1;
+
+    X86Gp index = a.newGpq();
+    a.mov(index, value);
+    if (low != 0)
+        a.sub(index, low);
+
+    // Below the lowest case wraps around to a large index.
+    a.cmp(index, range);
+    a.jae(otherwise);
+
+    Label table = a.newLabel();
+    X86Gp target = a.newGpq();
+    a.lea(target, x86::ptr(table));
+    a.mov(target, x86::ptr(target, index, 3));
+
+    Label chain = a.newLabel();
+    a.test(target, target);
+    a.jz(chain);
+    a.jmp(target);
+
+    a.bind(chain);
+    for (size_t i = 0; i < cases.size(); i++)
+    {
+        a.jz(cases[i].label);
+    }
+    a.jmp(otherwise);
+
+    a.align(kAlignData, 8);
+    a.bind(table);
+
+    size_t next = 0;
+    for (int64_t v = low; v < low + range; v++)
+    {
+        if (cases[next].value == v)
+            a.embedLabel(cases[next++].label);
+        else
+            a.embedLabel(otherwise);
+    }
+}
+
+void jit_switch(X86Compiler &a, ProgramData *statement, JitState &state)
+{
+    auto &vec = (*statement->value.children);
+    X86Gp value = jit_expression(a, vec[0].get(), state).reg;
+
+    std::vector<SwitchCase> cases;
+    for (size_t i = 2; i < vec.size(); i += 2)
+    {
+        cases.push_back({vec[i]->value.integer, a.newLabel()});
+    }
+
+    std::vector<SwitchCase> sorted = cases;
+    std::sort(sorted.begin(), sorted.end(), [](const SwitchCase &x, const SwitchCase &y) {
+        return x.value < y.value;
+    });
+
+    for (size_t i = 1; i < sorted.size(); i++)
+    {
+        if (sorted[i].value == sorted[i - 1].value)
+            throw strdup(("DUPLICATE CASE " + std::to_string(sorted[i].value)).c_str());
+    }
+
+    Label otherwise = a.newLabel();
+    Label end = a.newLabel();
+
+    int64_t range = sorted.empty() ? 0 : sorted.back().value - sorted.front().value + 1;
+    if (sorted.size() <= switch_chain_max)
+        jit_case_chain(a, value, sorted, 0, sorted.size(), otherwise);
+    else if (range <= switch_table_max && range <= (int64_t)sorted.size() * switch_table_spread)
+        jit_case_table(a, value, sorted, otherwise);
+    else
+        jit_case_tree(a, value, sorted, 0, sorted.size(), otherwise);
+
+    for (size_t i = 0; i < cases.size(); i++)
+    {
+        a.bind(cases[i].label);
+        state.nonnegative = -1;
+        jit_statement(a, vec[2 * i + 3].get(), state);
+        a.jmp(end);
+    }
+
+    a.bind(otherwise);
+    state.nonnegative = -1;
+    if (vec[1] != nullptr)
+        jit_statement(a, vec[1].get(), state);
+
+    a.bind(end);
+    state.nonnegative = -1;
+}
+
+void jit_statement(X86Compiler &a, ProgramData *statement, JitState &state)
+{
+    int nonnegative = state.nonnegative;
+    state.nonnegative = -1;
+
+    if (statement->type == TYPE_ASSIGNMENT)
+    {
+        ProgramData *target = (*statement->value.children)[0].get();
+        ProgramData *value = (*statement->value.children)[1].get();
+
+        // Stores out of range, or into something that is not a list, do
+        // nothing.
+        if (target->type == TYPE_SUBSCRIPT)
+        {
+            X86Gp index;
+            X86Gp receiver = jit_subscript_operands(a, target, state, index);
+            X86Gp v_reg = jit_expression(a, value, state).reg;
+
+            Label miss = a.newLabel();
+            a.mov(element_mem(a, target, state, receiver, index, miss), v_reg);
+            a.bind(miss);
+            return;
+        }
+
+        if (target->type == TYPE_INDEX)
+        {
+            auto &vec = (*target->value.children);
+            Expression receiver = jit_expression(a, vec[0].get(), state);
+            X86Gp v_reg = jit_expression(a, value, state).reg;
+
+            jit_field_set(a, state, receiver, vec[1]->value.symbol, v_reg, vec[0].get());
+            return;
+        }
+
+        int symbol = (*statement->value.children)[0]->value.symbol;
+
+        // The value is make_list(), which only has to empty the list.
+        if (int *slots = state.scalar_lists.find(symbol))
+        {
+            LocalVar *var = state.vars.find(symbol);
+            if (var == nullptr)
+            {
+                LocalVar list = {list_type, a.newGpq()};
+                list.mem = a.newStack(*slots * sizeof(uint64_t), 8);
+                list.list_slots = *slots;
+                var = &state.vars.insert(symbol, list);
+            }
+
+            a.xor_(var->reg, var->reg);
+            return;
+        }
+
+        Expression exp;
+        if (value->type == TYPE_FUNCTION_DEF)
+            exp = jit_function_def(a, value, state, symbol);
+        else
+            exp = jit_expression(a, value, state);
+
+        // A variable only keeps a type while every assignment compiled so
+        // far agrees on it. Code compiled before a later assignment can
+        // still see the old type, which is why builtin methods are guarded.
+        LocalVar *var = state.vars.find(symbol);
+        if (var == nullptr)
+            var = &state.vars.insert(symbol, {exp.type, a.newGpq()});
+        else if (var->type != exp.type)
+            var->type = nullptr;
+
+        write_var(a, *var, exp.reg);
+
+        if (exp.closure != nullptr && exp.closure->kind == CLOSURE_DIRECT)
+            var->direct = exp.closure;
+
+        // A function without captures only needs its slot to be called from
+        // outside.
+        if (state.analysis == &state.closures->entry)
+        {
+            if (value->type == TYPE_FUNCTION_DEF && exp.closure->kind == CLOSURE_PLAIN)
+            {
+                FunctionRemainder &def = state.remainders.back();
+                state.context->exports.set(symbol, {def.slot, (int)def.params.size()});
+            }
+            else if (ExportedFunction *exported = state.context->exports.find(symbol))
+                exported->slot = -1;
+        }
+
+        if (value->type == TYPE_INTEGER && value->value.integer >= 0)
+            state.nonnegative = symbol;
+
+        return;
+    }
+
+    if (statement->type == TYPE_RETURN)
+    {
+        ProgramData *value = (*statement->value.children)[0].get();
+
+        if (is_self_tail_call(value, state))
+        {
+            auto &vec = (*value->value.children);
+
+            // Every argument is evaluated before any parameter changes.
+            std::vector<X86Gp> args;
+            for (auto it = ++vec.begin(); it != vec.end(); ++it)
+            {
+                args.push_back(jit_expression(a, (*it).get(), state).reg);
+            }
+
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                a.mov(state.params[i], args[i]);
+            }
+
+            a.jmp(state.body);
+            return;
+        }
+
+        Expression exp = jit_expression(a, value, state);
+        a.ret(exp.reg);
+
+        return;
+    }
+
+    if (statement->type == TYPE_BLOCK)
+    {
+        auto &vec = (*statement->value.children);
+        for (auto it = vec.begin(); it != vec.end(); ++it)
+        {
+            jit_statement(a, (*it).get(), state);
+        }
+
+        return;
+    }
+
+    if (statement->type == TYPE_IF)
+    {
+        Label L1 = a.newLabel();
+        Label L2 = a.newLabel();
+
+        X86Gp reg = jit_expression(a, (*statement->value.children)[0].get(), state).reg;
+
+        a.cmp(reg, 0);
+        a.je(L1);
+
+        jit_statement(a, (*statement->value.children)[1].get(), state);
+        a.jmp(L2);
+        a.bind(L1);
+
+        // Facts from the then branch do not hold here.
+        state.nonnegative = -1;
+        if ((*statement->value.children)[2] != nullptr)
+            jit_statement(a, (*statement->value.children)[2].get(), state);        
+
+        a.bind(L2);
+        state.nonnegative = -1;
+
+        return;
+    }
+
+    if (statement->type == TYPE_SWITCH)
+    {
+        jit_switch(a, statement, state);
+        return;
+    }
+
+    if (statement->type == TYPE_WHILE)
+    {
+        // The index has to start out non-negative, and neither variable
+        // may be written by a closure.
+        int index, list;
+        bool counted = counted_loop(statement, index, list) && index == nonnegative &&
+                       is_register_var(state, index) && is_register_var(state, list);
+
+        Label L1 = a.newLabel();
+        Label L2 = a.newLabel();
+
+        a.bind(L1);
+        X86Gp reg = jit_expression(a, (*statement->value.children)[0].get(), state).reg;
+
+        a.cmp(reg, 0);
+        a.je(L2);
+
+        if (counted)
+            state.bounded.push_back(std::make_pair(list, index));
+
+        jit_statement(a, (*statement->value.children)[1].get(), state);
+
+        if (counted)
+            state.bounded.pop_back();
+
+        a.jmp(L1);
+
+        a.bind(L2);
+        state.nonnegative = -1;
+
+        return;
+    }
+
+    jit_expression(a, statement, state);
+}
+
+typedef int (*SumFunc)();
+
+void submit_functions(CompileContext &ctx, std::vector<FunctionRemainder> &remainders)
+{
+    if (remainders.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(ctx.lock);
+    for (auto it = remainders.begin(); it != remainders.end(); ++it)
+    {
+        ctx.queue.push_back(std::move(*it));
+        ctx.pending++;
+    }
+    remainders.clear();
+
+    ctx.changed.notify_all();
+}
+
+std::unique_ptr<CompiledFunction> compile_function(CompileContext &ctx, FunctionRemainder &frem)
+{
+    std::unique_ptr<CompiledFunction> out(new CompiledFunction());
+    out->slot = frem.slot;
+    out->key = frem.key;
+    out->code.init(CodeInfo(ArchInfo::kTypeX64));
+    if (ctx.log_asm)
+        out->code.setLogger(&out->logger);
+
+    X86Compiler a(&out->code);
+
+    const FunctionAnalysis &fa = *frem.analysis;
+    bool env = fa.kind == CLOSURE_STACK || fa.kind == CLOSURE_HEAP;
+    size_t hidden = fa.kind == CLOSURE_DIRECT ? fa.captures.size() : 0;
+
+    FuncSignatureX signature(CallConv::kIdHost);
+    signature.setRetT<uint64_t>();
+    for (size_t i = 0; i < (env ? 1 : 0) + frem.params.size() + hidden; i++)
+    {
+        signature.addArgT<uint64_t>();
+    }
+
+    CCFunc *func = a.addFunc(signature);
+    out->entry = func->getLabel();
+
+    JitState s = { {}, {}, ctx.globals, {}, &ctx, frem.slot, frem.self, func->getLabel(), a.newLabel() };
+    s.nonnegative = -1;
+    s.closures = frem.closures;
+    s.analysis = &fa;
+
+    int arg = 0;
+    if (env)
+    {
+        s.env = a.newGpq();
+        a.setArg(arg++, s.env);
+    }
+
+    // Arguments arrive in registers and stay there as ordinary locals.
+    for (size_t i = 0; i < frem.params.size(); i++)
+    {
+        X86Gp reg = a.newGpq();
+        a.setArg(arg++, reg);
+
+        s.vars.insert(frem.params[i], {nullptr, reg});
+        s.params.push_back(reg);
+    }
+
+    // Captures come after the arguments or out of the closure object, as
+    // values or as the address of the variable in its owner.
+    X86Gp obj;
+    if (env)
+    {
+        obj = a.newGpq();
+        a.mov(obj, s.env);
+        a.and_(obj, int_const(a, s, kConstScopeGlobal, ~NUM_BIT));
+    }
+
+    for (size_t i = 0; i < fa.captures.size(); i++)
+    {
+        X86Gp reg = a.newGpq();
+        if (env)
+            a.mov(reg, x86::qword_ptr(obj, closure_captures_offset + i * sizeof(uint64_t)));
+        else
+            a.setArg(arg++, reg);
+
+        LocalVar var = {nullptr, reg};
+        if (fa.captures[i].pointer)
+        {
+            var.home = HOME_POINTER;
+            var.mem = x86::qword_ptr(reg);
+        }
+
+        s.vars.insert(fa.captures[i].symbol, var);
+    }
+
+    for (auto it = fa.globals.begin(); it != fa.globals.end(); ++it)
+    {
+        LocalVar var = {nullptr, X86Gp(), HOME_GLOBAL, module_global(ctx, *it)};
+        s.vars.insert(*it, var);
+    }
 
-        return {v_reg, get_return_type(nullptr), false};
+    std::vector<int> outside = frem.params;
+    for (auto it = fa.captures.begin(); it != fa.captures.end(); ++it)
+    {
+        outside.push_back(it->symbol);
     }
+    outside.insert(outside.end(), fa.globals.begin(), fa.globals.end());
+    s.scalar_lists = find_scalar_lists(frem.data.get(), outside);
 
-    if (expression->type == TYPE_INDEX)
+    // Threads calling the same function race on the counter, which only
+    // loses calls.
+    if (layout_profile.counting)
     {
-        auto &vec = (*expression->value.children);
-        Expression exp = jit_expression(a, vec[0].get(), state);
+        X86Gp counter = a.newGpq();
+        a.mov(counter, int_const(a, s, kConstScopeLocal, (int64_t)&out->calls));
+        a.inc(x86::qword_ptr(counter));
+    }
 
-        Type *t = exp.type;
-        char *property = vec[1]->value.str;
+    a.bind(s.body);
 
-        if (t == nullptr)
-            throw "TYPE WAS NULL";
+    // Every call (tail calls included) gets its own stack slots and boxes.
+    place_vars(a, s, fa.homes);
 
-        if (t->function_lookup.find(property) == t->function_lookup.end())
-            throw ("TYPE DOES NOT HAVE " + std::string(property)).c_str();
+    jit_statement(a, frem.data.get(), s);
 
-        int function_number = t->function_lookup[property];
+    X86Gp r = a.newGpq();
 
-        X86Mem c0 = a.newInt64Const(kConstScopeLocal, ~(NUM_BIT));
+    a.mov(r, 0);
+    a.ret(r);
+
+    a.endFunc();
+    a.finalize();
 
-        X86Gp copy = a.newGpq();
-        a.mov(copy, exp.reg);
+    if (a.isInErrorState())
+        throw DebugUtils::errorAsString(a.getLastError());
 
-        a.and_(exp.reg, c0);
-        X86Mem m = x86::ptr(exp.reg, offsetof(Obj, funcs));
-        X86Gp obj = a.newGpq("Index");
-        m.setSize(sizeof(generic_fp**));
-        a.mov(obj, m);
-        a.mov(obj, x86::ptr(obj));
-        a.mov(obj, x86::ptr(obj, function_number*sizeof(generic_fp)));
+    frem.data.reset();
+    submit_functions(ctx, s.remainders);
 
-        return {obj, t->functions.type[function_number], t->functions.is_method[function_number], copy};
-    }
+    return out;
+}
 
-    if (expression->type == TYPE_IDENTIFIER)
+// Function bodies do not depend on each other until they are linked, so
+// every thread (including the main one once the entry function is done)
+// takes bodies off the queue until nothing is pending.
+void compile_worker(CompileContext &ctx)
+{
+    MemScope scope(MEM_COMPILER);
+    MemBudgetScope budget(ctx.budget);
+    std::unique_lock<std::mutex> guard(ctx.lock);
+    while (true)
     {
-        if (state.vars.find(expression->value.str) != state.vars.end())
-        {
-            StackVar var = state.vars[expression->value.str];
+        ctx.changed.wait(guard, [&] {
+            return !ctx.queue.empty() || !ctx.error.empty() || (ctx.closed && ctx.pending == 0);
+        });
 
-            X86Gp v_reg = a.newGpq();
-            state.mem.setSize(8);
-            state.mem.setOffset(var.stack_offset);  
+        if (!ctx.error.empty() || ctx.queue.empty())
+            return;
 
-            a.mov(v_reg, state.mem);
+        FunctionRemainder frem = std::move(ctx.queue.front());
+        ctx.queue.pop_front();
+        guard.unlock();
 
-            return {v_reg, var.type, false};
+        std::unique_ptr<CompiledFunction> compiled;
+        std::string error;
+        try {
+            compiled = compile_function(ctx, frem);
+        } catch (char const* err) {
+            error = err;
         }
-        else if (state.globals.find(expression->value.str) != state.globals.end())
-        {
-            GlobalVar var = state.globals[expression->value.str];
 
-            X86Gp v_reg = a.newGpq();
-            X86Mem c0 = a.newInt64Const(kConstScopeGlobal, var.value);
-            a.mov(v_reg, c0);
+        if (mem_exceeded(ctx.budget))
+            error = "OUT OF MEMORY";
 
-            return {v_reg, var.type, false};
-        }
-        else
-        {
-            throw ("USING " + std::string(expression->value.str) + " BEFORE DEFINED").c_str();
-        }
+        guard.lock();
+        if (!error.empty() && ctx.error.empty())
+            ctx.error = error;
+        else if (compiled)
+            ctx.functions.push_back(std::move(compiled));
+
+        ctx.pending--;
+        ctx.changed.notify_all();
     }
+}
 
-    if (expression->type == TYPE_FUNCTION)
+void finish_workers(CompileContext &ctx, std::vector<std::thread> &workers, bool failed)
+{
     {
-        auto &vec = (*expression->value.children);
+        std::lock_guard<std::mutex> guard(ctx.lock);
+        ctx.closed = true;
+        if (failed && ctx.error.empty())
+            ctx.error = "ABORTED";
+        ctx.changed.notify_all();
+    }
 
-        Expression exp = jit_expression(a, vec[0].get(), state);
-        X86Gp func = exp.reg;
-        Type *type = exp.type;
+    if (!failed)
+        compile_worker(ctx);
 
-        X86Gp args[vec.size()];
-        int arg_num = 0;
-        for (auto it = ++vec.begin(); it != vec.end(); ++it)
+    for (auto it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+// Copies every compiled function into one block of the code arena, then
+// fills in the function slots so code can find the other functions.
+// Functions go in slot order, or hottest first when laid out by a profile.
+uint8_t *link_functions(CompileContext &ctx, size_t &size)
+{
+    std::sort(ctx.functions.begin(), ctx.functions.end(),
+              [](const std::unique_ptr<CompiledFunction> &x, const std::unique_ptr<CompiledFunction> &y) {
+                  if (layout_profile.ordered)
+                  {
+                      uint64_t calls_x = layout_calls(x->key);
+                      uint64_t calls_y = layout_calls(y->key);
+                      if (calls_x != calls_y)
+                          return calls_x > calls_y;
+                  }
+
+                  return x->slot < y->slot;
+              });
+
+    std::vector<size_t> offsets;
+    size = 0;
+    for (auto it = ctx.functions.begin(); it != ctx.functions.end(); ++it)
+    {
+        (*it)->code.sync();
+        offsets.push_back(size);
+        size += ((*it)->code.getCodeSize() + 15) & ~(size_t)15;
+    }
+
+    uint8_t *base = arena_alloc(code_arena, size);
+    if (base == nullptr)
+        return nullptr;
+
+    for (size_t i = 0; i < ctx.functions.size(); i++)
+    {
+        CompiledFunction &f = *ctx.functions[i];
+        if (f.code.relocate(base + offsets[i]) == 0)
         {
-            args[arg_num++] = jit_expression(a, (*it).get(), state).reg;
+            arena_free(code_arena, base, size);
+            return nullptr;
         }
 
-        int off = exp.is_method ? 1 : 0;
+        f.address = base + offsets[i];
+        f.size = f.code.getCodeSize();
 
-        X86Gp ret = a.newGpq();
-        CCFuncCall *node;
-        switch (vec.size() + off)
-        {
-            case 0:
-                node = a.call(func, FuncSignature0<uint64_t>(CallConv::kIdHostCDecl));
-                break;
-            case 1:
-                node = a.call(func, FuncSignature1<uint64_t, uint64_t>(CallConv::kIdHostCDecl));
-                break;
-            case 2:
-                node = a.call(func, FuncSignature2<uint64_t, uint64_t, uint64_t>(CallConv::kIdHostCDecl));
-                break;
-            case 3:
-                node = a.call(func, FuncSignature3<uint64_t, uint64_t, uint64_t, uint64_t>(CallConv::kIdHostCDecl));
-                break;
-            case 4:
-                node = a.call(func, FuncSignature4<uint64_t, uint64_t, uint64_t, uint64_t, uint64_t>(CallConv::kIdHostCDecl));
-                break;
-        }
+        uint8_t *entry = base + offsets[i] + f.code.getLabelOffset(f.entry);
+        *function_slot(ctx.slots, f.slot) = (uint64_t)(uintptr_t)entry;
+    }
 
-        if (exp.is_method)
+    return base;
+}
+
+// Pages the code spans, and the ones of functions that ran.
+void count_code_pages(CompileContext &ctx, CompileStats &stats)
+{
+    const uintptr_t page = 4096;
+    std::set<uintptr_t> pages, hot_pages;
+
+    for (auto it = ctx.functions.begin(); it != ctx.functions.end(); ++it)
+    {
+        CompiledFunction &f = **it;
+        if (f.size == 0)
+            continue;
+
+        bool hot = f.calls > 0 || layout_calls(f.key) > 0;
+        if (hot)
         {
-            node->setArg(0, exp.object);
+            stats.hot_functions++;
+            stats.hot_bytes += f.size;
         }
 
-        for (int i = 0; i < vec.size(); i++)
+        uintptr_t start = (uintptr_t)f.address;
+        for (uintptr_t p = start / page; p <= (start + f.size - 1) / page; p++)
         {
-            node->setArg(i + off, args[i]);
+            pages.insert(p);
+            if (hot)
+                hot_pages.insert(p);
         }
-        node->setRet(0, ret);
-
-        return {ret, type->return_type};
     }
 
-    if (expression->type == TYPE_SUB)
+    stats.code_pages = pages.size();
+    stats.hot_pages = hot_pages.size();
+}
+
+// Calls of every function, with the functions that hash the same added up.
+bool write_profile(CompileContext &ctx, const char *path)
+{
+    std::unordered_map<uint64_t, uint64_t> calls;
+    for (auto it = ctx.functions.begin(); it != ctx.functions.end(); ++it)
     {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+        if ((*it)->key != 0)
+            calls[(*it)->key] += (*it)->calls;
+    }
 
-        a.sub(reg_a, reg_b);
+    std::vector<std::pair<uint64_t, uint64_t>> counts(calls.begin(), calls.end());
+    std::sort(counts.begin(), counts.end());
 
-        return {reg_a, nullptr};
-    }
+    return layout_write(path, counts);
+}
 
-    if (expression->type == TYPE_ADD)
-    {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+// Types and builtins are registered once per process and shared by every
+// program compiled in it.
+const SymbolMap<GlobalVar> &builtin_globals()
+{
+    static SymbolMap<GlobalVar> globals;
+    static std::once_flag once;
 
-        a.add(reg_a, reg_b);
+    std::call_once(once, [] {
+        MemScope scope(MEM_COMPILER);
+        JitState s = {};
+        register_types(s);
+        globals = s.globals;
+    });
 
-        return {reg_a, nullptr};
-    }
+    return globals;
+}
 
-    if (expression->type == TYPE_MULT)
-    {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+// A compiled program. Once linked, the code of all its functions lives in
+// one block of the code arena that belongs to the program.
+struct Program
+{
+    CompileContext ctx;
 
-        a.imul(reg_a, reg_b);
+    // The top level is split into entry functions that run in order, see
+    // end_entry.
+    std::vector<int> entries;
+    uint8_t *code;
+    size_t code_size;
 
-        return {reg_a, nullptr};
-    }
+    // Set once the top level has run. Exports read top-level variables,
+    // which hold nothing before that.
+    std::atomic<bool> ran;
+};
 
-    if (expression->type == TYPE_DIV)
-    {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
-        X86Gp reg_c = a.newGpq();
+// Top-level statements per entry function, so that the IR of the compiler
+// stays small however long the top level is.
+const int entry_statements = 256;
 
-        a.mov(reg_c, 0);
-        a.idiv(reg_c, reg_a, reg_b);
+void start_entry(Program &program, JitState &s, std::unique_ptr<CompiledFunction> &func, std::unique_ptr<X86Compiler> &a)
+{
+    CompileContext &ctx = program.ctx;
 
-        return {reg_a, nullptr};
-    }
+    s.slot = new_function_slot(ctx.slots);
+    program.entries.push_back(s.slot);
 
-    if (expression->type == TYPE_NOTEQUALITY)
-    {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+    func.reset(new CompiledFunction());
+    func->slot = s.slot;
+    func->code.init(CodeInfo(ArchInfo::kTypeX64));
+    if (ctx.log_asm)
+        func->code.setLogger(&func->logger);
 
-        a.sub(reg_a, reg_b);
-        a.setne(reg_a);
+    a.reset(new X86Compiler(&func->code));
+    func->entry = a->addFunc(FuncSignature0<void>())->getLabel();
+    s.entry = func->entry;
+}
 
-        return {reg_a, nullptr};
-    }
+// The next entry function can take over once every top-level variable is
+// either in a register, which is then stored to its module global, or
+// already there. Variables on the stack and lists kept in registers do not
+// survive the return, so while there are any the current function goes on.
+bool can_end_entry(JitState &s)
+{
+    if (s.scalar_lists.size() > 0)
+        return false;
 
-    if (expression->type == TYPE_EQUALITY)
+    for (int i = 0; i < s.vars.size(); i++)
     {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+        LocalVar &var = s.vars.entries[i];
+        if ((var.home != HOME_REGISTER && var.home != HOME_GLOBAL) || var.list_slots > 0)
+            return false;
+    }
 
-        a.sub(reg_a, reg_b);
-        a.sete(reg_a);
+    return true;
+}
 
-        return {reg_a, nullptr};
+void end_entry(CompileContext &ctx, JitState &s, std::unique_ptr<CompiledFunction> &func, std::unique_ptr<X86Compiler> &a)
+{
+    for (int i = 0; i < s.vars.size(); i++)
+    {
+        LocalVar &var = s.vars.entries[i];
+        if (var.home == HOME_REGISTER)
+        {
+            var.mem = module_global(ctx, s.vars.keys[i]);
+            var.home = HOME_GLOBAL;
+            a->mov(var.mem, var.reg);
+        }
     }
+    s.nonnegative = -1;
 
-    if (expression->type == TYPE_LT)
-    {
-        X86Gp reg_a = jit_expression(a, (*expression->value.children)[0].get(), state).reg;
-        X86Gp reg_b = jit_expression(a, (*expression->value.children)[1].get(), state).reg;
+    if (a->isInErrorState())
+        printf("ERROR: %s\n", DebugUtils::errorAsString(a->getLastError()));
 
-        a.sub(reg_a, reg_b);
-        a.setl(reg_a);
+    a->endFunc();                          // End of the function body.
 
-        return {reg_a, nullptr};
-    }
+    // Register allocation and encoding both happen in finalize().
+    a->finalize();
+    a.reset();
 
-    throw strdup(("UNKOWN EXPRESSION " + std::to_string(expression->type)).c_str());
+    std::lock_guard<std::mutex> guard(ctx.lock);
+    ctx.functions.push_back(std::move(func));
 }
 
-void jit_statement(X86Compiler &a, ProgramData *statement, JitState &state)
+// Compiles every statement of source. On failure error is set and the
+// workers have been stopped. The compile has a memory budget of its own,
+// which is checked after every statement and every function.
+bool compile_program(Program &program, SourceStream &source, int jobs, BenchReport &report, std::string &error)
 {
-    if (statement->type == TYPE_ASSIGNMENT)
+    CompileContext &ctx = program.ctx;
+    MemScope scope(MEM_COMPILER);
+
+    MemBudget budget;
+    mem_budget_init(budget, mem_limit);
+    MemBudgetScope budget_scope(&budget);
+    ctx.budget = &budget;
+
+    JitState s = { {}, {}, builtin_globals(), {}, &ctx, -1, -1 };
+    s.nonnegative = -1;
+    ctx.globals = s.globals;
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < jobs; i++)
+    {
+        workers.emplace_back(compile_worker, std::ref(ctx));
+    }
+
+    std::unique_ptr<CompiledFunction> main_func;
+    std::unique_ptr<X86Compiler> compiler;
+    start_entry(program, s, main_func, compiler);
+    int statements = 0;
+
+    // Every top-level statement is compiled as soon as it is parsed and its
+    // AST is freed before the next one is read.
+    while (!source_done(source)) 
     {
-        Expression exp = jit_expression(a, (*statement->value.children)[1].get(), state);
+        X86Compiler &a = *compiler;
 
-        auto var = (*statement->value.children)[0]->value.str;
-        if (state.vars.find(var) == state.vars.end())
+        bench_start(report);
+        ParserResult res = source_statement(source);
+        bench_stop(report, PHASE_PARSE);
+
+        if (!res.success) 
         {
-            state.vars[var] = {exp.type, state.offset};
-            state.offset += 8;
+            error = "ERROR IN PARSING";
+            finish_workers(ctx, workers, true);
+            return false;
         }
 
-        state.mem.setSize(8);
-        state.mem.setOffset(state.vars[var].stack_offset);
+        if (compile_stats.enabled)
+            count_nodes(res.data.get(), compile_stats);
 
-        a.mov(state.mem, exp.reg);
-
-        return;
-    }
+        bench_start(report);
+        try {
+            // Variables of the entry function that closures in this
+            // statement need outside of a register are moved before it runs.
+            s.closures = analyze_closures(res.data.get(), s.vars.keys, s.globals);
+            s.analysis = &s.closures->entry;
+            place_vars(a, s, s.closures->entry.homes);
 
-    if (statement->type == TYPE_RETURN)
-    {
-        Expression exp = jit_expression(a, (*statement->value.children)[0].get(), state);
-        a.ret(exp.reg);
+            jit_statement(a, res.data.get(), s);
+        } catch (char const* err) {
+            error = err;
+            finish_workers(ctx, workers, true);
+            return false;
+        }
+        submit_functions(ctx, s.remainders);
+        bench_stop(report, PHASE_CODEGEN);
 
-        return;
-    }
+        if (mem_exceeded(&budget))
+        {
+            error = "OUT OF MEMORY";
+            finish_workers(ctx, workers, true);
+            return false;
+        }
 
-    if (statement->type == TYPE_BLOCK)
-    {
-        auto &vec = (*statement->value.children);
-        for (auto it = vec.begin(); it != vec.end(); ++it)
+        if (++statements >= entry_statements && can_end_entry(s))
         {
-            jit_statement(a, (*it).get(), state);
+            bench_start(report);
+            end_entry(ctx, s, main_func, compiler);
+            start_entry(program, s, main_func, compiler);
+            bench_stop(report, PHASE_FINALIZE);
+            statements = 0;
         }
+    }
 
-        return;
+    bench_start(report);
+    end_entry(ctx, s, main_func, compiler);
+    bench_stop(report, PHASE_FINALIZE);
+
+    // Function bodies are compiled and finalized on the workers, so their
+    // register allocation is part of this phase.
+    bench_start(report);
+    finish_workers(ctx, workers, false);
+    bench_stop(report, PHASE_CODEGEN);
+
+    if (!ctx.error.empty())
+    {
+        error = ctx.error;
+        return false;
     }
 
-    if (statement->type == TYPE_IF)
+    if (mem_exceeded(&budget))
     {
-        Label L1 = a.newLabel();
-        Label L2 = a.newLabel();
+        error = "OUT OF MEMORY";
+        return false;
+    }
 
-        X86Gp reg = jit_expression(a, (*statement->value.children)[0].get(), state).reg;
+    return true;
+}
 
-        a.cmp(reg, 0);
-        a.je(L1);
+bool link_program(Program &program)
+{
+    program.code = link_functions(program.ctx, program.code_size);
+    return program.code != nullptr;
+}
 
-        jit_statement(a, (*statement->value.children)[1].get(), state);
-        a.jmp(L2);
-        a.bind(L1);
+void program_run(Program &program)
+{
+    for (auto it = program.entries.begin(); it != program.entries.end(); ++it)
+    {
+        ((SumFunc)*function_slot(program.ctx.slots, *it))();
+    }
+}
 
-        if ((*statement->value.children)[2] != nullptr)
-            jit_statement(a, (*statement->value.children)[2].get(), state);        
+// Functions assigned at the top level that capture nothing, once the top
+// level has run.
+bool program_export(Program &program, const char *name, void *&code, int &arity)
+{
+    if (!program.ran)
+        return false;
 
-        a.bind(L2);
+    int symbol = find_symbol(name);
+    ExportedFunction *exported = symbol >= 0 ? program.ctx.exports.find(symbol) : nullptr;
+    if (exported == nullptr || exported->slot < 0)
+        return false;
 
-        return;
-    }
+    code = (void *)*function_slot(program.ctx.slots, exported->slot);
+    arity = exported->arity;
+    return true;
+}
 
-    if (statement->type == TYPE_WHILE)
+const int call_max_args = 6;
+
+uint64_t call_function(void *code, int arity, const uint64_t *args)
+{
+    typedef uint64_t A;
+
+    switch (arity)
     {
+    case 0: return ((A (*)())code)();
+    case 1: return ((A (*)(A))code)(args[0]);
+    case 2: return ((A (*)(A, A))code)(args[0], args[1]);
+    case 3: return ((A (*)(A, A, A))code)(args[0], args[1], args[2]);
+    case 4: return ((A (*)(A, A, A, A))code)(args[0], args[1], args[2], args[3]);
+    case 5: return ((A (*)(A, A, A, A, A))code)(args[0], args[1], args[2], args[3], args[4]);
+    case 6: return ((A (*)(A, A, A, A, A, A))code)(args[0], args[1], args[2], args[3], args[4], args[5]);
+    }
 
-        Label L1 = a.newLabel();
-        Label L2 = a.newLabel();
+    return 0;
+}
 
-        a.bind(L1);
-        X86Gp reg = jit_expression(a, (*statement->value.children)[0].get(), state).reg;
+void free_program(Program *program)
+{
+    if (program->code != nullptr)
+        arena_free(code_arena, program->code, program->code_size);
 
-        a.cmp(reg, 0);
-        a.je(L2);
+    for (auto it = program->ctx.module_chunks.begin(); it != program->ctx.module_chunks.end(); ++it)
+    {
+        arena_free(code_arena, (uint8_t *)*it, arena_page);
+    }
 
-        jit_statement(a, (*statement->value.children)[1].get(), state);
-        a.jmp(L1);
+    for (auto it = program->ctx.slots.chunks.begin(); it != program->ctx.slots.chunks.end(); ++it)
+    {
+        delete[] *it;
+    }
 
-        a.bind(L2);
+    for (auto it = program->ctx.field_caches.begin(); it != program->ctx.field_caches.end(); ++it)
+    {
+        delete *it;
+    }
 
-        return;
+    // Layouts and function types stay: they are shared by every program.
+    for (auto it = program->ctx.strings.begin(); it != program->ctx.strings.end(); ++it)
+    {
+        operator delete(valueToObj(it->second));
     }
 
-    jit_expression(a, statement, state);
+    delete program;
 }
 
-typedef int (*SumFunc)();
+#ifndef JITLANG_LIBRARY
 
-int main(int argc, char const *argv[])
+#include "server.cpp"
+
+struct Options
+{
+    const char *path;
+    const char *socket_path;
+    bool serve;
+    const char *asm_path;
+    const char *bench_path;
+    const char *profile_path;
+    const char *layout_path;
+    bool lock_code;
+    bool time;
+    bool stats;
+    bool mem_stats;
+    bool no_uring;
+    int64_t mem_limit_mb;
+    int jobs;
+    int threads;
+};
+
+void usage(const char *name)
 {
-    JitRuntime rt;
-    FileLogger logger(stdout); 
+    printf("USAGE: %s [options] file\n", name);
+    printf("       %s [options] --serve | --socket PATH\n", name);
+    printf("    --asm FILE      write the assembly listing to FILE (- for stdout)\n");
+    printf("    --time          print per-phase timers to stderr\n");
+    printf("    --stats         print compile statistics to stderr\n");
+    printf("    --bench FILE    append per-phase results as a JSON line to FILE\n");
+    printf("    --jobs N        compile function bodies on N threads (default: all cores)\n");
+    printf("    --threads N     run the parallel builtins on N threads (default: all cores)\n");
+    printf("    --profile FILE  count calls of every function and write them to FILE\n");
+    printf("    --layout FILE   place functions hottest first by the counts in FILE\n");
+    printf("    --lock-code     lock and prefault executable memory\n");
+    printf("    --mem-stats     print memory use per subsystem to stderr at exit\n");
+    printf("    --mem-limit MB  fail a compile or run once it uses more than MB megabytes\n");
+    printf("    --no-uring      do file I/O on threads instead of io_uring\n");
+    printf("    --serve         compile and run scripts sent on stdin, see server.cpp\n");
+    printf("    --socket PATH   the same on a local socket at PATH\n");
+}
 
-    CodeHolder code;
-    code.init(CodeInfo(ArchInfo::kTypeX64));
-    code.setLogger(&logger);
+bool parse_options(int argc, char const *argv[], Options &opts)
+{
+    opts = {};
+    opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--asm") == 0 && i + 1 < argc)
+            opts.asm_path = argv[++i];
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            opts.bench_path = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            opts.profile_path = argv[++i];
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+            opts.layout_path = argv[++i];
+        else if (strcmp(argv[i], "--lock-code") == 0)
+            opts.lock_code = true;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            opts.jobs = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            opts.threads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--time") == 0)
+            opts.time = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+            opts.stats = true;
+        else if (strcmp(argv[i], "--mem-stats") == 0)
+            opts.mem_stats = true;
+        else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc)
+            opts.mem_limit_mb = std::max(1ll, atoll(argv[++i]));
+        else if (strcmp(argv[i], "--no-uring") == 0)
+            opts.no_uring = true;
+        else if (strcmp(argv[i], "--serve") == 0)
+            opts.serve = true;
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+            opts.socket_path = argv[++i];
+        else if (argv[i][0] == '-')
+            return false;
+        else
+            opts.path = argv[i];
+    }
 
-    X86Compiler a(&code);
-    a.addFunc(FuncSignature0<void>()); 
+    if (opts.serve || opts.socket_path != nullptr)
+        return opts.path == nullptr;
 
-    ParserResult res;
+    return opts.path != nullptr;
+}
 
-    std::ifstream t(argv[1]);
-    std::string program((std::istreambuf_iterator<char>(t)),
-                     std::istreambuf_iterator<char>());
+int main(int argc, char const *argv[])
+{
+    Options opts;
+    if (!parse_options(argc, argv, opts))
+    {
+        usage(argv[0]);
+        return 1;
+    }
 
-    JitState s = { 0, {}, {}, {}, a.newStack(256, 8), a.newIntPtr("i"), {} };
+    BenchReport report;
+    bench_init(report, opts.bench_path != nullptr || opts.time);
+    compile_stats.enabled = opts.stats;
+    pool_threads = opts.threads;
+    mem_limit = opts.mem_limit_mb << 20;
+    io_uring_disabled = opts.no_uring;
 
-    register_types(s);
-    // register_functions(s.funcs);
+    code_arena.locked = opts.lock_code;
+    layout_profile.counting = opts.profile_path != nullptr;
+    if (opts.layout_path != nullptr && !layout_read(opts.layout_path))
+    {
+        printf("COULD NOT OPEN %s\n", opts.layout_path);
+        return 1;
+    }
 
-    while (!program.empty()) 
+    if (opts.serve || opts.socket_path != nullptr)
     {
-        res = statement(program);
-        if (!res.success) 
+        Server server;
+        server.jobs = opts.jobs;
+
+        if (opts.socket_path == nullptr)
         {
-            printf("ERROR IN PARSING\n");
-            return 0;
+            output_fd = STDERR_FILENO;
+            serve_stream(server, STDIN_FILENO, STDOUT_FILENO);
+        }
+        else if (!serve_socket(server, opts.socket_path))
+        {
+            printf("COULD NOT LISTEN ON %s\n", opts.socket_path);
+            return 1;
         }
 
-        try {
-            jit_statement(a, res.data.get(), s);
-        } catch (char const* err) {
-            printf("%s\n", err);
-            return 0;
+        output_flush_all();
+        if (opts.mem_stats)
+            mem_print(stderr);
+        return 0;
+    }
+
+    // Formatting the listing is a large part of compile time, so it is only
+    // produced when asked for.
+    FILE *asm_file = nullptr;
+    if (opts.asm_path != nullptr)
+    {
+        asm_file = strcmp(opts.asm_path, "-") == 0 ? stdout : fopen(opts.asm_path, "w");
+        if (asm_file == nullptr)
+        {
+            printf("COULD NOT OPEN %s\n", opts.asm_path);
+            return 1;
         }
-        program = res.remainder;
     }
 
-    if (a.isInErrorState())
-        printf("ERROR: %s\n", DebugUtils::errorAsString(a.getLastError()));
+    Program *program = new Program();
+    CompileContext &ctx = program->ctx;
+    ctx.log_asm = asm_file != nullptr;
+
+    SourceStream source;
+    if (!source_open(source, opts.path))
+    {
+        printf("COULD NOT OPEN %s\n", opts.path);
+        return 1;
+    }
 
-    a.endFunc();                           // End of the function body.
-    
-    while (!s.remainders.empty())
+    std::string error;
+    if (!compile_program(*program, source, opts.jobs, report, error))
     {
-        s = { 0, {}, {}, s.globals, a.newStack(256, 8), a.newIntPtr("i"), std::move(s.remainders) };
+        printf("%s\n", error.c_str());
+        return 0;
+    }
 
-        FunctionRemainder frem = std::move(s.remainders[0]);
-        s.remainders.erase(s.remainders.begin());
+    source_close(source);
 
-        a.addFunc(frem.func);
+    bench_start(report);
+    bool linked = link_program(*program);
+    bench_stop(report, PHASE_LOAD);
+
+    if (!linked) {
+        printf("wack\n");
+        return 1;
+    }
 
-        try {
-            jit_statement(a, frem.data.get(), s);
-        } catch (char const* err) {
-            printf("%s\n", err);
-            return 0;
-        }
 
-        X86Gp r = a.newGpq();
+    compile_stats.functions = ctx.functions.size();
+    compile_stats.code_bytes = program->code_size;
 
-        a.mov(r, 0);
-        a.ret(r);
+    if (asm_file != nullptr)
+    {
+        for (auto it = ctx.functions.begin(); it != ctx.functions.end(); ++it)
+        {
+            fputs((*it)->logger.getString(), asm_file);
+        }
 
-        a.endFunc();
+        if (asm_file == stdout)
+            printf("\nRUNNING\n\n");
+        else
+            fclose(asm_file);
     }
 
-    a.finalize();
+    // Scripts write to stdout through output.cpp, not stdio.
+    fflush(stdout);
 
-    SumFunc fn;
-    Error err = rt.add(&fn, &code);
+    bench_start(report);
+    bool ran;
+    {
+        MemScope scope(MEM_OBJECTS);
+        ran = run_budgeted([&] { program_run(*program); });    // Execute the generated code.
+        program->ran = ran;
+    }
+    output_flush_all();
+    bench_stop(report, PHASE_RUN);
 
-    if (err) {
-        printf("wack\n");
+    if (!ran)
+    {
+        fprintf(stderr, "OUT OF MEMORY: over the limit of %lld bytes\n", (long long)mem_limit);
         return 1;
     }
 
-    printf("\nRUNNING\n\n");
+    if (opts.profile_path != nullptr && !write_profile(ctx, opts.profile_path))
+        fprintf(stderr, "COULD NOT WRITE %s\n", opts.profile_path);
+
+    if (opts.stats)
+        count_code_pages(ctx, compile_stats);
 
-    fn();              // Execute the generated code.
+    if (opts.time)
+        bench_print(report, stderr);
+
+    if (opts.stats)
+        stats_print(compile_stats, stderr);
+
+    if (opts.mem_stats)
+        mem_print(stderr);
+
+    if (opts.bench_path != nullptr)
+        bench_write(report, opts.bench_path, opts.path);
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,242 @@
+#include <emmintrin.h>
+#include <stdlib.h>
+
+// Hash map keyed by tagged values, laid out like a Swiss table: one control
+// byte per slot, holding 7 bits of the key's hash for a full slot or one of
+// two special values, and slots grouped by 16 so one SSE2 compare checks a
+// whole group. Lookups start at the group picked by the rest of the hash and
+// move on to the next group in a triangular sequence until a group with an
+// empty slot is found. Heap strings compare by their text, every other key
+// by its bits.
+
+const int map_group_size = 16;
+
+const int8_t ctrl_empty = (int8_t)0x80;
+const int8_t ctrl_deleted = (int8_t)0xfe;
+
+struct MapSlot
+{
+    uint64_t key;
+    uint64_t value;
+};
+
+struct Map : public Obj
+{
+    // 16 byte aligned, capacity bytes.
+    int8_t *ctrl;
+    MapSlot *slots;
+
+    // Number of groups minus one.
+    uint64_t group_mask;
+
+    int64_t size;
+
+    // Empty slots that may still be used before the table grows, which
+    // keeps the load factor at or below 7/8.
+    int64_t growth_left;
+};
+
+// Offsets used by compiled code.
+const int32_t map_ctrl_offset = sizeof(Obj);
+const int32_t map_slots_offset = sizeof(Obj) + 8;
+const int32_t map_group_mask_offset = sizeof(Obj) + 16;
+
+// Compiled lookups compute the same hash (see emit_map_lookup).
+const uint64_t map_hash_multiplier = 0x9e3779b97f4a7c15ull;
+
+Type *map_type;
+
+inline uint64_t map_hash(uint64_t key)
+{
+    uint64_t h = key * map_hash_multiplier;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t map_key_hash(uint64_t key)
+{
+    if (isHeapString(key))
+        return map_hash(((String *)valueToObj(key))->hash);
+
+    return map_hash(key);
+}
+
+inline int8_t map_h2(uint64_t hash)
+{
+    return hash & 0x7f;
+}
+
+inline uint64_t map_first_group(Map *m, uint64_t hash)
+{
+    return (hash >> 7) & m->group_mask;
+}
+
+inline uint32_t group_match(const int8_t *group, int8_t value)
+{
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+}
+
+// Empty and deleted are the only control bytes with the top bit set.
+inline uint32_t group_match_free(const int8_t *group)
+{
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+}
+
+void map_allocate(Map *m, int64_t capacity)
+{
+    m->ctrl = (int8_t *)mem_alloc(capacity, map_group_size);
+    memset(m->ctrl, ctrl_empty, capacity);
+
+    m->slots = new MapSlot[capacity];
+    m->group_mask = capacity / map_group_size - 1;
+    m->growth_left = capacity - capacity / 8;
+}
+
+Map *make_map()
+{
+    Map *m = (Map *)setup_object(new Map(), map_type);
+
+    map_allocate(m, map_group_size);
+    m->size = 0;
+
+    return m;
+}
+
+MapSlot *map_find(Map *m, uint64_t key)
+{
+    bool text = isHeapString(key);
+    uint64_t hash = map_key_hash(key);
+    uint64_t group = map_first_group(m, hash);
+
+    for (uint64_t probe = 1; ; probe++)
+    {
+        int8_t *ctrl = m->ctrl + group * map_group_size;
+
+        for (uint32_t bits = group_match(ctrl, map_h2(hash)); bits != 0; bits &= bits - 1)
+        {
+            MapSlot *slot = &m->slots[group * map_group_size + __builtin_ctz(bits)];
+            if (slot->key == key || (text && string_equal({slot->key}, {key})))
+                return slot;
+        }
+
+        if (group_match(ctrl, ctrl_empty) != 0)
+            return nullptr;
+
+        group = (group + probe) & m->group_mask;
+    }
+}
+
+// First empty or deleted slot on the probe sequence of hash.
+int64_t map_find_free(Map *m, uint64_t hash)
+{
+    uint64_t group = map_first_group(m, hash);
+
+    for (uint64_t probe = 1; ; probe++)
+    {
+        uint32_t bits = group_match_free(m->ctrl + group * map_group_size);
+        if (bits != 0)
+            return group * map_group_size + __builtin_ctz(bits);
+
+        group = (group + probe) & m->group_mask;
+    }
+}
+
+// Grows the table, or only clears deleted slots out of it when it is not
+// that full.
+void map_rehash(Map *m)
+{
+    mem_check();
+
+    int64_t capacity = (m->group_mask + 1) * map_group_size;
+    int8_t *ctrl = m->ctrl;
+    MapSlot *slots = m->slots;
+
+    map_allocate(m, m->size * 16 > capacity * 7 ? capacity * 2 : capacity);
+
+    for (int64_t i = 0; i < capacity; i++)
+    {
+        if (ctrl[i] < 0)
+            continue;
+
+        uint64_t hash = map_key_hash(slots[i].key);
+        int64_t index = map_find_free(m, hash);
+
+        m->ctrl[index] = map_h2(hash);
+        m->slots[index] = slots[i];
+        m->growth_left--;
+    }
+
+    mem_release(ctrl);
+    delete[] slots;
+}
+
+uint64_t map_get(Map *m, uint64_t key)
+{
+    MapSlot *slot = map_find(m, key);
+    return slot != nullptr ? slot->value : 0;
+}
+
+bool map_has(Map *m, uint64_t key)
+{
+    return map_find(m, key) != nullptr;
+}
+
+Map *map_set(Map *m, uint64_t key, uint64_t value)
+{
+    if (MapSlot *slot = map_find(m, key))
+    {
+        slot->value = value;
+        return m;
+    }
+
+    uint64_t hash = map_key_hash(key);
+    int64_t index = map_find_free(m, hash);
+
+    // Reusing a deleted slot does not use up an empty one.
+    if (m->ctrl[index] == ctrl_empty)
+    {
+        if (m->growth_left == 0)
+        {
+            map_rehash(m);
+            index = map_find_free(m, hash);
+        }
+
+        m->growth_left--;
+    }
+
+    m->ctrl[index] = map_h2(hash);
+    m->slots[index] = {key, value};
+    m->size++;
+
+    return m;
+}
+
+// A slot can go back to empty when its group still has an empty slot: the
+// group has then never been full, so no probe sequence continues past it.
+bool map_remove(Map *m, uint64_t key)
+{
+    MapSlot *slot = map_find(m, key);
+    if (slot == nullptr)
+        return false;
+
+    int64_t index = slot - m->slots;
+    int8_t *group = m->ctrl + (index & ~(int64_t)(map_group_size - 1));
+
+    if (group_match(group, ctrl_empty) != 0)
+    {
+        m->ctrl[index] = ctrl_empty;
+        m->growth_left++;
+    }
+    else
+    {
+        m->ctrl[index] = ctrl_deleted;
+    }
+
+    m->size--;
+    return true;
+}
+
+int64_t map_count(Map *m)
+{
+    return m->size;
+}
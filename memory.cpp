@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Memory accounting. Every operator new and delete in the process goes
+// through here and is charged to the subsystem the allocating thread is
+// working for, which a MemScope sets: parsing, compiling (the compiler's
+// own structures and the type tables; asmjit allocates with malloc and is
+// not included), runtime objects of scripts, and code (blocks of the code
+// arena). Each allocation carries a small header that remembers its
+// subsystem and size, so it is given back to the right counter wherever
+// it is freed. Counts are kept per thread and summed when read, so threads
+// allocating at once never write the same cache line.
+//
+// With --mem-limit (jitlang_set_memory_limit in libjitlang) every compile
+// and every run gets a budget of its own, which the threads working for it
+// charge. A compile that goes over it fails after the statement or the
+// function it was on; a run is stopped at the next allocation made from
+// compiled code (see mem_check) and fails, and the process goes on.
+//
+// libjitlang does not replace operator new, which would take over the
+// allocator of the program it is linked into; there only code, the tables
+// of maps and the strings of the parser are counted.
+
+enum MemSubsystem
+{
+    MEM_OTHER,
+    MEM_PARSER,
+    MEM_COMPILER,
+    MEM_OBJECTS,
+    MEM_CODE,
+
+    MEM_COUNT,
+};
+
+const char *mem_subsystem_names[MEM_COUNT] = { "other", "parser", "compiler", "objects", "code" };
+
+struct MemCounter
+{
+    std::atomic<int64_t> live;
+    std::atomic<int64_t> peak;
+    std::atomic<int64_t> allocations;
+};
+
+// What every thread has folded in, and the counts of threads that ended.
+MemCounter mem_counters[MEM_COUNT];
+
+// Counts of one thread, only written by it. Live bytes are folded into
+// mem_counters once they move by mem_fold_step, which is when the peak is
+// updated, so the peak is short by at most that much per thread.
+struct MemThreadCounts
+{
+    std::atomic<int64_t> live[MEM_COUNT];
+    std::atomic<int64_t> allocations[MEM_COUNT];
+    int state;
+    MemThreadCounts *next;
+};
+
+enum
+{
+    MEM_THREAD_NEW,
+    MEM_THREAD_LISTED,
+    MEM_THREAD_ENDED,
+};
+
+const int64_t mem_fold_step = 1 << 16;
+
+// Trivial, so that it needs no initialization on the allocation path.
+thread_local MemThreadCounts mem_thread;
+
+std::mutex mem_threads_lock;
+MemThreadCounts *mem_threads = nullptr;
+
+void mem_fold(MemSubsystem subsystem, int64_t size)
+{
+    MemCounter &c = mem_counters[subsystem];
+
+    int64_t live = c.live.fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t peak = c.peak.load(std::memory_order_relaxed);
+    while (live > peak && !c.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Folds the counts of a thread that ends into mem_counters and takes it
+// off the list. Later allocations of the thread go to mem_counters.
+struct MemThreadEnd
+{
+    ~MemThreadEnd()
+    {
+        std::lock_guard<std::mutex> guard(mem_threads_lock);
+
+        MemThreadCounts &t = mem_thread;
+        for (int i = 0; i < MEM_COUNT; i++)
+        {
+            mem_fold((MemSubsystem)i, t.live[i].load(std::memory_order_relaxed));
+            mem_counters[i].allocations.fetch_add(t.allocations[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            t.live[i].store(0, std::memory_order_relaxed);
+            t.allocations[i].store(0, std::memory_order_relaxed);
+        }
+
+        MemThreadCounts **link = &mem_threads;
+        while (*link != &t)
+            link = &(*link)->next;
+        *link = t.next;
+
+        t.state = MEM_THREAD_ENDED;
+    }
+};
+
+thread_local MemThreadEnd mem_thread_end;
+
+// Neither this nor registering the destructor of mem_thread_end allocates
+// with operator new.
+void mem_list_thread()
+{
+    (void)&mem_thread_end;
+
+    std::lock_guard<std::mutex> guard(mem_threads_lock);
+    mem_thread.next = mem_threads;
+    mem_threads = &mem_thread;
+    mem_thread.state = MEM_THREAD_LISTED;
+}
+
+// Summed over every thread; the peak is never below what is live now.
+MemCounter &mem_read(MemCounter &out, MemSubsystem subsystem)
+{
+    MemCounter &c = mem_counters[subsystem];
+
+    std::lock_guard<std::mutex> guard(mem_threads_lock);
+    int64_t live = c.live.load(std::memory_order_relaxed);
+    int64_t allocations = c.allocations.load(std::memory_order_relaxed);
+    for (MemThreadCounts *t = mem_threads; t != nullptr; t = t->next)
+    {
+        live += t->live[subsystem].load(std::memory_order_relaxed);
+        allocations += t->allocations[subsystem].load(std::memory_order_relaxed);
+    }
+
+    out.live = live;
+    out.peak = std::max(live, c.peak.load(std::memory_order_relaxed));
+    out.allocations = allocations;
+    return out;
+}
+
+// Limit of every budget, 0 for none.
+std::atomic<int64_t> mem_limit(0);
+
+thread_local MemSubsystem mem_subsystem = MEM_OTHER;
+
+struct MemScope
+{
+    MemSubsystem saved;
+
+    MemScope(MemSubsystem subsystem) : saved(mem_subsystem)
+    {
+        mem_subsystem = subsystem;
+    }
+
+    ~MemScope()
+    {
+        mem_subsystem = saved;
+    }
+};
+
+// What one compile or one run has live. Allocations remember the id of
+// the budget that was charged, and a free only gives the bytes back to
+// the budget of the thread freeing them if it is the same one, so a budget
+// is never looked at once its run is over.
+struct MemBudget
+{
+    uint32_t id;
+    int64_t limit;
+    std::atomic<int64_t> used;
+    std::atomic<bool> exceeded;
+};
+
+std::atomic<uint32_t> mem_budget_ids(0);
+
+thread_local MemBudget *mem_budget = nullptr;
+
+// Where a run that went over its budget is left, or nullptr where it must
+// not be: on threads of the pool, and in natives that hold memory or
+// locks of their own (see MemNoEscape).
+thread_local jmp_buf *mem_escape = nullptr;
+
+void mem_budget_init(MemBudget &budget, int64_t limit)
+{
+    uint32_t id = ++mem_budget_ids;
+    budget.id = id != 0 ? id : ++mem_budget_ids;
+    budget.limit = limit;
+    budget.used = 0;
+    budget.exceeded = false;
+}
+
+bool mem_exceeded(MemBudget *budget)
+{
+    return budget != nullptr && budget->exceeded.load(std::memory_order_relaxed);
+}
+
+// Makes the thread work for budget until the scope ends.
+struct MemBudgetScope
+{
+    MemBudget *saved;
+
+    MemBudgetScope(MemBudget *budget) : saved(mem_budget)
+    {
+        mem_budget = budget;
+    }
+
+    ~MemBudgetScope()
+    {
+        mem_budget = saved;
+    }
+};
+
+struct MemNoEscape
+{
+    jmp_buf *saved;
+
+    MemNoEscape() : saved(mem_escape)
+    {
+        mem_escape = nullptr;
+    }
+
+    ~MemNoEscape()
+    {
+        mem_escape = saved;
+    }
+};
+
+// Leaves the run if it went over its budget. The longjmp skips the C++
+// destructors of everything above it on the stack, so it is only called
+// at the start of allocation paths that hold nothing yet, with nothing but
+// compiled code and natives without destructors to run above them:
+// setup_object (objects, strings, lists, maps and closures), the growth of
+// list_add_element, map_rehash and make_box. Natives that do hold
+// something, like the file builtins, run under a MemNoEscape.
+void mem_check()
+{
+    if (mem_escape != nullptr && mem_exceeded(mem_budget))
+        longjmp(*mem_escape, 1);
+}
+
+// Sits right before the memory handed out; offset leads back to what
+// malloc returned.
+struct MemHeader
+{
+    uint32_t budget;
+    uint16_t subsystem;
+    uint16_t offset;
+    uint64_t size;
+};
+
+static_assert(sizeof(MemHeader) == 16, "headers keep malloc's alignment");
+
+void mem_count(MemSubsystem subsystem, int64_t size)
+{
+    MemThreadCounts &t = mem_thread;
+    if (t.state != MEM_THREAD_LISTED)
+    {
+        if (t.state == MEM_THREAD_ENDED)
+        {
+            if (size > 0)
+                mem_counters[subsystem].allocations.fetch_add(1, std::memory_order_relaxed);
+            mem_fold(subsystem, size);
+            return;
+        }
+
+        mem_list_thread();
+    }
+
+    if (size > 0)
+        t.allocations[subsystem].store(t.allocations[subsystem].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    int64_t live = t.live[subsystem].load(std::memory_order_relaxed) + size;
+    if (live > mem_fold_step || live < -mem_fold_step)
+    {
+        mem_fold(subsystem, live);
+        live = 0;
+    }
+    t.live[subsystem].store(live, std::memory_order_relaxed);
+}
+
+// Charges (or with a negative size gives back to) the thread's budget.
+// Without a limit there is nothing to check it against.
+void mem_charge(int64_t size)
+{
+    MemBudget *budget = mem_budget;
+    if (budget == nullptr || budget->limit == 0)
+        return;
+
+    int64_t used = budget->used.fetch_add(size, std::memory_order_relaxed) + size;
+    if (used > budget->limit)
+        budget->exceeded.store(true, std::memory_order_relaxed);
+}
+
+// align is a power of two of at least 16.
+void *mem_alloc(size_t size, size_t align)
+{
+    size_t offset = std::max(align, sizeof(MemHeader));
+
+    void *raw = align > 16 ? aligned_alloc(align, (offset + size + align - 1) & ~(align - 1)) : malloc(offset + size);
+    if (raw == nullptr)
+        return nullptr;
+
+    MemHeader *header = (MemHeader *)((char *)raw + offset) - 1;
+    header->budget = mem_budget != nullptr ? mem_budget->id : 0;
+    header->subsystem = mem_subsystem;
+    header->offset = offset;
+    header->size = size;
+
+    mem_count(mem_subsystem, size);
+    mem_charge(size);
+    return (char *)raw + offset;
+}
+
+void mem_release(void *p)
+{
+    if (p == nullptr)
+        return;
+
+    MemHeader *header = (MemHeader *)p - 1;
+    mem_count((MemSubsystem)header->subsystem, -(int64_t)header->size);
+    if (header->budget != 0 && mem_budget != nullptr && header->budget == mem_budget->id)
+        mem_charge(-(int64_t)header->size);
+
+    free((char *)p - header->offset);
+}
+
+#ifndef JITLANG_LIBRARY
+void *operator new(size_t size)
+{
+    void *p = mem_alloc(size, 16);
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return mem_alloc(size, 16);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return mem_alloc(size, 16);
+}
+
+void operator delete(void *p) noexcept
+{
+    mem_release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    mem_release(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    mem_release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    mem_release(p);
+}
+#endif
+
+void mem_print(FILE *f)
+{
+    fprintf(f, "%-10s %14s %14s %14s\n", "memory", "live", "peak", "allocations");
+    for (int i = 0; i < MEM_COUNT; i++)
+    {
+        MemCounter c;
+        mem_read(c, (MemSubsystem)i);
+        fprintf(f, "%-10s %14lld %14lld %14lld\n", mem_subsystem_names[i], (long long)c.live.load(),
+                (long long)c.peak.load(), (long long)c.allocations.load());
+    }
+}
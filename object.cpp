@@ -0,0 +1,189 @@
+#include <atomic>
+#include <mutex>
+
+// User objects ({x: 1, y: 2}). The layout of an object is its hidden class:
+// a Type whose fields map names to slots. Layouts form a tree rooted at
+// object_type, the empty object, with one transition per added field, so
+// objects that got the same fields in the same order share a Type and
+// compiled code can check Obj::type and then use a constant offset. Like
+// every Type, layouts are shared by all programs and never freed.
+
+// The first fields are stored in the object itself, the rest in overflow.
+const int object_inline_slots = 8;
+
+struct Object : public Obj
+{
+    uint64_t *overflow;
+    uint64_t slots[object_inline_slots];
+};
+
+// Offsets used by compiled code.
+const int32_t object_overflow_offset = sizeof(Obj);
+const int32_t object_slots_offset = sizeof(Obj) + 8;
+
+// Last layout seen by one field access in compiled code: the type number in
+// the low half and the byte offset of the field in the high half, so that
+// threads never see one without the other.
+struct FieldCache
+{
+    std::atomic<uint64_t> entry;
+};
+
+const uint64_t field_cache_empty = 0xffffffff;
+
+std::mutex transitions_lock;
+Type *object_type;
+
+Type *object_transition(Type *t, int field)
+{
+    std::lock_guard<std::mutex> guard(transitions_lock);
+
+    if (Type **next = t->transitions.find(field))
+        return *next;
+
+    Type *next = register_type("object");
+    next->object = true;
+    next->fields = t->fields;
+    next->fields.insert(field, t->fields.size());
+
+    t->transitions.insert(field, next);
+    return next;
+}
+
+// Layout of an object literal with the given fields, in order.
+Type *object_layout(const std::vector<int> &fields)
+{
+    Type *t = object_type;
+    for (auto it = fields.begin(); it != fields.end(); ++it)
+    {
+        if (t->fields.find(*it) == nullptr)
+            t = object_transition(t, *it);
+    }
+
+    return t;
+}
+
+int64_t overflow_capacity(int64_t fields)
+{
+    int64_t n = fields - object_inline_slots;
+    if (n <= 0)
+        return 0;
+
+    int64_t capacity = 4;
+    while (capacity < n)
+    {
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+// Every layout shares the (empty) function table of object_type, so adding
+// a field only has to change Obj::type.
+Object *make_object(Type *t)
+{
+    Object *o = new Object();
+    setup_object(o, t);
+    o->funcs = &object_type->functions.func;
+
+    int64_t capacity = overflow_capacity(t->fields.size());
+    o->overflow = capacity > 0 ? new uint64_t[capacity]() : nullptr;
+
+    return o;
+}
+
+inline Object *as_object(uint64_t value)
+{
+    if (!isObj(value))
+        return nullptr;
+
+    Obj *o = valueToObj(value);
+    return type_by_number(o->type)->object ? (Object *)o : nullptr;
+}
+
+inline uint64_t *object_field(Object *o, int index)
+{
+    if (index < object_inline_slots)
+        return &o->slots[index];
+
+    return &o->overflow[index - object_inline_slots];
+}
+
+void cache_field(FieldCache *cache, Object *o, int index)
+{
+    if (cache == nullptr || index >= object_inline_slots)
+        return;
+
+    uint64_t offset = object_slots_offset + index * sizeof(uint64_t);
+    cache->entry.store((offset << 32) | (uint32_t)o->type, std::memory_order_relaxed);
+}
+
+// Slow paths of field access. Reading a missing field, or a field of
+// something that is not an object, gives 0; setting a field of a non
+// object does nothing.
+uint64_t object_get(uint64_t value, int64_t field, FieldCache *cache)
+{
+    Object *o = as_object(value);
+    if (o == nullptr)
+        return 0;
+
+    int *index = type_by_number(o->type)->fields.find(field);
+    if (index == nullptr)
+        return 0;
+
+    cache_field(cache, o, *index);
+    return *object_field(o, *index);
+}
+
+uint64_t object_set(uint64_t value, int64_t field, uint64_t v, FieldCache *cache)
+{
+    Object *o = as_object(value);
+    if (o == nullptr)
+        return 0;
+
+    Type *t = type_by_number(o->type);
+    if (int *index = t->fields.find(field))
+    {
+        cache_field(cache, o, *index);
+        *object_field(o, *index) = v;
+        return 0;
+    }
+
+    int count = t->fields.size();
+    int64_t capacity = overflow_capacity(count);
+    if (count >= object_inline_slots && count - object_inline_slots >= capacity)
+    {
+        uint64_t *overflow = new uint64_t[overflow_capacity(count + 1)]();
+        for (int64_t i = 0; i < capacity; i++)
+        {
+            overflow[i] = o->overflow[i];
+        }
+
+        delete[] o->overflow;
+        o->overflow = overflow;
+    }
+
+    *object_field(o, count) = v;
+    o->type = object_transition(t, field)->type_number;
+
+    return 0;
+}
+
+// Method of whatever the value is, or 0, for calls through a receiver of
+// unknown type.
+uint64_t lookup_method(uint64_t value, int64_t symbol)
+{
+    Type *t;
+    if (isObj(value))
+        t = type_by_number(valueToObj(value)->type);
+    else if (isSmallString(value))
+        t = string_type;
+    else
+        return 0;
+
+    int *method = t->function_lookup.find(symbol);
+    if (method == nullptr || !t->functions.is_method[*method])
+        return 0;
+
+    return funcToValue(t->functions.func[*method]);
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <vector>
+#include <mutex>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+// Standard output of scripts. Every thread appends to its own buffer, which
+// goes out in one write() when it is full, when the thread finishes a pool
+// task, before a parallel range starts and at exit. Output therefore keeps
+// the order of the script, no line is split between two threads and the
+// common case takes no lock. A thread that ends writes out its buffer and
+// gives it back.
+
+const size_t output_buffer_size = 1 << 20;
+
+// Room format_int needs for one number and a newline.
+const size_t output_int_size = 21;
+
+struct OutputBuffer
+{
+    char *data;
+    size_t size;
+};
+
+// Standard error for the compile server on standard input, whose replies
+// own standard output.
+int output_fd = STDOUT_FILENO;
+
+std::mutex output_lock;
+std::vector<OutputBuffer *> output_buffers;
+thread_local OutputBuffer *output_local = nullptr;
+
+void output_write(OutputBuffer &out);
+
+struct OutputRelease
+{
+    OutputBuffer *buffer = nullptr;
+
+    ~OutputRelease()
+    {
+        if (buffer == nullptr)
+            return;
+
+        {
+            std::lock_guard<std::mutex> guard(output_lock);
+            output_buffers.erase(std::find(output_buffers.begin(), output_buffers.end(), buffer));
+        }
+
+        if (buffer->size > 0)
+            output_write(*buffer);
+
+        output_local = nullptr;
+        delete[] buffer->data;
+        delete buffer;
+    }
+};
+
+thread_local OutputRelease output_release;
+
+OutputBuffer &output_buffer()
+{
+    if (output_local == nullptr)
+    {
+        output_local = new OutputBuffer();
+        output_local->data = new char[output_buffer_size];
+        output_local->size = 0;
+        output_release.buffer = output_local;
+
+        std::lock_guard<std::mutex> guard(output_lock);
+        output_buffers.push_back(output_local);
+    }
+
+    return *output_local;
+}
+
+void output_send(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(output_fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        data += n;
+        size -= n;
+    }
+}
+
+void output_write(OutputBuffer &out)
+{
+    output_send(out.data, out.size);
+    out.size = 0;
+}
+
+void output_flush()
+{
+    if (output_local != nullptr && output_local->size > 0)
+        output_write(*output_local);
+}
+
+// Only safe once no script code runs on other threads.
+void output_flush_all()
+{
+    std::lock_guard<std::mutex> guard(output_lock);
+    for (auto it = output_buffers.begin(); it != output_buffers.end(); ++it)
+    {
+        if ((*it)->size > 0)
+            output_write(**it);
+    }
+}
+
+// Space for at least n bytes (n at most output_buffer_size), to be filled
+// and then handed to output_commit.
+inline char *output_reserve(size_t n)
+{
+    OutputBuffer &out = output_buffer();
+    if (out.size + n > output_buffer_size)
+        output_write(out);
+
+    return out.data + out.size;
+}
+
+inline void output_commit(char *end)
+{
+    output_local->size = end - output_local->data;
+}
+
+void output_bytes(const char *chars, size_t n)
+{
+    OutputBuffer &out = output_buffer();
+    if (n > output_buffer_size - out.size)
+    {
+        output_write(out);
+        if (n > output_buffer_size)
+        {
+            output_send(chars, n);
+            return;
+        }
+    }
+
+    memcpy(out.data + out.size, chars, n);
+    out.size += n;
+}
+
+void output_text(const char *text)
+{
+    output_bytes(text, strlen(text));
+}
+
+const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes value in decimal at p, two digits at a time, and returns the end.
+// Needs 20 bytes.
+char *format_int(char *p, int64_t value)
+{
+    uint64_t v = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    if (value < 0)
+        *p++ = '-';
+
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *q = end;
+
+    while (v >= 100)
+    {
+        q -= 2;
+        memcpy(q, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+
+    if (v >= 10)
+    {
+        q -= 2;
+        memcpy(q, digit_pairs + v * 2, 2);
+    }
+    else
+    {
+        *--q = '0' + v;
+    }
+
+    memcpy(p, q, end - q);
+    return p + (end - q);
+}
+
+void output_int_line(int64_t value)
+{
+    char *p = format_int(output_reserve(output_int_size), value);
+    *p++ = '\n';
+    output_commit(p);
+}
@@ -19,6 +19,7 @@ union ProgramValue
     int64_t integer;
     bool boolean;
     char *str;
+    int symbol;
     std::vector<std::unique_ptr<ProgramData>> *children;
 };
 
@@ -27,16 +28,20 @@ enum ProgramType
     TYPE_INTEGER,
     TYPE_BOOLEAN,
     TYPE_STR,
+    TYPE_STRING,
     TYPE_IDENTIFIER,
     TYPE_INDEX,
+    TYPE_SUBSCRIPT,
     TYPE_FUNCTION,
     TYPE_FUNCTION_DEF,
+    TYPE_OBJECT,
 
     TYPE_ASSIGNMENT,
     TYPE_RETURN,
     TYPE_BLOCK,
     TYPE_IF,
     TYPE_WHILE,
+    TYPE_SWITCH,
 
     TYPE_EQUALITY,
     TYPE_NOTEQUALITY,
@@ -46,12 +51,34 @@ enum ProgramType
     TYPE_DIV,
     TYPE_ADD,
     TYPE_SUB,
+
+    TYPE_COUNT,
+};
+
+const char *program_type_names[TYPE_COUNT] = {
+    "integer", "boolean", "str", "string", "identifier", "index", "subscript", "function", "function_def", "object",
+    "assignment", "return", "block", "if", "while", "switch",
+    "equality", "notequality", "lt",
+    "mult", "div", "add", "sub",
 };
 
+bool has_children(ProgramType type)
+{
+    return type != TYPE_INTEGER && type != TYPE_BOOLEAN && type != TYPE_STR && type != TYPE_STRING && type != TYPE_IDENTIFIER;
+}
+
 struct ProgramData
 {
     ProgramType type;
     ProgramValue value;
+
+    ~ProgramData()
+    {
+        if (has_children(type))
+            delete value.children;
+        else if (type == TYPE_STR || type == TYPE_STRING)
+            mem_release(value.str);
+    }
 };
 
 struct ParserResult
@@ -100,10 +127,24 @@ char* strdup(const char* str)
       return newstr;
 }
 
+// Text of string nodes, counted with the parser's memory.
+char *copy_text(const std::string &text)
+{
+    char *copy = (char *)mem_alloc(text.size() + 1, 16);
+    if (copy != nullptr)
+        memcpy(copy, text.c_str(), text.size() + 1);
+
+    return copy;
+}
+
+// Takes over whatever data owns; data is left as a plain integer node so
+// the caller's copy does not free it a second time.
 ParserResult success(std::string program, ProgramData &data) 
 {
     eat_whitespace(program);
-    return {true, program, std::make_unique<ProgramData>(data)};
+    ParserResult result = {true, program, std::make_unique<ProgramData>(data)};
+    data.type = TYPE_INTEGER;
+    return result;
 }
 
 std::function<ParserResult(std::string)> any(std::vector<std::function<ParserResult(std::string)>> parsers)
@@ -128,7 +169,7 @@ std::function<ParserResult(std::string)> match(std::string match_str)
         if (program.find(match_str) != 0)
             return failure();
 
-        ProgramData data = { TYPE_STR, { .str = strdup(match_str.c_str()) } };
+        ProgramData data = { TYPE_STR, { .str = copy_text(match_str) } };
         return success(program.substr(match_str.size()), data);
     };
 }
@@ -186,24 +227,46 @@ ParserResult function(std::string program, ParserResult caller)
 
     res = match(")")(program);
     if (!res.success)
+    {
+        delete children;
         return caller;
+    }
 
     children->insert(children->begin(), std::move(caller.data));
 
     ProgramData data = { TYPE_FUNCTION, { .children = children } };
     auto s = success(res.remainder, data);
-    return index(s.remainder, std::move(s));
+    std::string remainder = s.remainder;
+    return index(remainder, std::move(s));
 }
 
-ParserResult identifier(std::string program);
+ParserResult name(std::string program);
 
+// a.b.c is (a.b).c; the property is always a plain name. l[i] has the
+// list and the index expression as children.
 ParserResult index(std::string program, ParserResult result)
 {
+    if (!program.empty() && program.at(0) == '[')
+    {
+        std::vector<ParserResult> results = seq({match("["), expression, match("]")})(program);
+        if (results.empty())
+            return result;
+
+        auto *children = new std::vector<std::unique_ptr<ProgramData>>();
+        children->push_back(std::move(result.data));
+        children->push_back(std::move(results[1].data));
+
+        ProgramData data = { TYPE_SUBSCRIPT, { .children = children } };
+        auto s = success(results[2].remainder, data);
+        std::string remainder = s.remainder;
+        return index(remainder, std::move(s));
+    }
+
     if (program.empty() || program.at(0) != '.')
         return result;
     program.erase(0, 1);
 
-    ParserResult iden = identifier(program);
+    ParserResult iden = name(program);
     if (!iden.success)
         return result;
 
@@ -212,10 +275,12 @@ ParserResult index(std::string program, ParserResult result)
     children->push_back(std::move(iden.data));
 
     ProgramData data = { TYPE_INDEX, { .children = children } };
-    return success(iden.remainder, data);
+    auto s = success(iden.remainder, data);
+    std::string remainder = s.remainder;
+    return index(remainder, std::move(s));
 }
 
-ParserResult identifier(std::string program)
+ParserResult name(std::string program)
 {
     std::string id;
     while (!program.empty() && (is_letter(program.at(0)) || (!id.empty() && program.at(0) == '_')))
@@ -227,9 +292,18 @@ ParserResult identifier(std::string program)
     if (id.empty())
         return failure();
 
-    ProgramData data = { TYPE_IDENTIFIER, { .str = strdup(id.c_str()) } };
-    auto s = success(program, data);
-    return index(s.remainder, std::move(s));
+    ProgramData data = { TYPE_IDENTIFIER, { .symbol = intern(id) } };
+    return success(program, data);
+}
+
+ParserResult identifier(std::string program)
+{
+    ParserResult result = name(program);
+    if (!result.success)
+        return result;
+
+    std::string remainder = result.remainder;
+    return index(remainder, std::move(result));
 }
 
 ParserResult number(std::string program)
@@ -254,16 +328,99 @@ ParserResult number(std::string program)
     return success(program, data);
 }
 
+// "text", with \n, \t, \" and \\ escapes.
+ParserResult string_literal(std::string program)
+{
+    if (program.empty() || program.at(0) != '"')
+        return failure();
+
+    std::string text;
+    size_t i = 1;
+    while (i < program.size() && program.at(i) != '"')
+    {
+        char c = program.at(i++);
+        if (c == '\\' && i < program.size())
+        {
+            c = program.at(i++);
+            if (c == 'n')
+                c = '\n';
+            else if (c == 't')
+                c = '\t';
+        }
+
+        text += c;
+    }
+
+    if (i == program.size())
+        return failure();
+
+    ProgramData data = { TYPE_STRING, { .str = copy_text(text) } };
+    auto s = success(program.substr(i + 1), data);
+    std::string remainder = s.remainder;
+    return index(remainder, std::move(s));
+}
+
 ParserResult addop(std::string program);
 
+// {x: 1, y: 2}. Children alternate between a field name and its value.
+ParserResult object_literal(std::string program)
+{
+    ParserResult res = match("{")(program);
+    if (!res.success)
+        return failure();
+
+    program = res.remainder;
+
+    auto *children = new std::vector<std::unique_ptr<ProgramData>>();
+
+    ParserResult field = name(program);
+    while (field.success)
+    {
+        std::vector<ParserResult> results = seq({match(":"), expression})(field.remainder);
+        if (results.empty())
+        {
+            delete children;
+            return failure();
+        }
+
+        children->push_back(std::move(field.data));
+        children->push_back(std::move(results[1].data));
+        program = results[1].remainder;
+
+        res = match(",")(program);
+        if (!res.success)
+            break;
+
+        field = name(res.remainder);
+        if (!field.success)
+        {
+            delete children;
+            return failure();
+        }
+    }
+
+    res = match("}")(program);
+    if (!res.success)
+    {
+        delete children;
+        return failure();
+    }
+
+    ProgramData data = { TYPE_OBJECT, { .children = children } };
+    auto s = success(res.remainder, data);
+    std::string remainder = s.remainder;
+    return index(remainder, std::move(s));
+}
+
 ParserResult atom(std::string program)
 {
-    ParserResult result = any({number, identifier})(program);
+    ParserResult result = any({number, string_literal, identifier, object_literal})(program);
     if (result.success)
     {
         while (true) {
-            auto len = result.remainder.size();
-            result = function(result.remainder, std::move(result));
+            std::string remainder = result.remainder;
+            auto len = remainder.size();
+            result = function(remainder, std::move(result));
             if (len == result.remainder.size())
                 return result;
         }
@@ -275,7 +432,7 @@ ParserResult atom(std::string program)
         return failure();
 
     results[1].remainder = results[2].remainder;
-    return function(results[1].remainder, std::move(results[1]));
+    return function(results[2].remainder, std::move(results[1]));
 }
 
 ParserResult term(std::string program)
@@ -385,15 +542,55 @@ ParserResult assignment(std::string program)
 
 ParserResult block(std::string program);
 
+ParserResult parameter(std::string program)
+{
+    ParserResult result = identifier(program);
+    if (!result.success || result.data->type != TYPE_IDENTIFIER)
+        return failure();
+
+    return result;
+}
+
+// Children are the body followed by one identifier per parameter.
 ParserResult function_definition(std::string program)
 {
-    std::vector<ParserResult> results = seq({match("function"), match("("), match(")"), match("{"), block, match("}")})(program);
+    std::vector<ParserResult> results = seq({match("function"), match("(")})(program);
 
     if (results.empty())
         return failure();
 
+    program = results[1].remainder;
+
     auto *children = new std::vector<std::unique_ptr<ProgramData>>();
-    children->push_back(std::move(results[4].data));
+    children->push_back(nullptr);
+
+    ParserResult param = parameter(program);
+    while (param.success)
+    {
+        children->push_back(std::move(param.data));
+        program = param.remainder;
+
+        param = match(",")(program);
+        if (!param.success)
+            break;
+
+        param = parameter(param.remainder);
+        if (!param.success)
+        {
+            delete children;
+            return failure();
+        }
+    }
+
+    results = seq({match(")"), match("{"), block, match("}")})(program);
+
+    if (results.empty())
+    {
+        delete children;
+        return failure();
+    }
+
+    (*children)[0] = std::move(results[2].data);
 
     program = results[results.size()-1].remainder;
 
@@ -428,13 +625,19 @@ ParserResult if_statement(std::string program)
             ParserResult else_block = block(program);
 
             if (!else_block.success)
+            {
+                delete children;
                 return failure();
+            }
 
             program = else_block.remainder;
             res = match("}")(program);
 
             if (!res.success)
+            {
+                delete children;
                 return failure();
+            }
 
             program = res.remainder;
             children->push_back(std::move(else_block.data));
@@ -443,7 +646,10 @@ ParserResult if_statement(std::string program)
         {
             res = if_statement(program);
             if (!res.success)
+            {
+                delete children;
                 return failure();
+            }
 
             program = res.remainder;
             children->push_back(std::move(res.data));
@@ -473,6 +679,56 @@ ParserResult while_loop(std::string program)
     return success(results[results.size()-1].remainder, data);
 }
 
+// switch (value) { case 1: {...} case 2: {...} default: {...} }
+//
+// Children are the value, the default block or null, then every case as a
+// label and a block. Cases do not fall through.
+ParserResult switch_statement(std::string program)
+{
+    std::vector<ParserResult> results = seq({match("switch"), match("("), expression, match(")"), match("{")})(program);
+
+    if (results.empty())
+        return failure();
+
+    auto *children = new std::vector<std::unique_ptr<ProgramData>>();
+    children->push_back(std::move(results[2].data));
+    children->push_back(nullptr);
+
+    program = results[results.size()-1].remainder;
+
+    while (true)
+    {
+        results = seq({match("case"), number, match(":"), match("{"), block, match("}")})(program);
+        if (!results.empty())
+        {
+            children->push_back(std::move(results[1].data));
+            children->push_back(std::move(results[4].data));
+            program = results[results.size()-1].remainder;
+            continue;
+        }
+
+        results = seq({match("default"), match(":"), match("{"), block, match("}")})(program);
+        if (!results.empty() && (*children)[1] == nullptr)
+        {
+            (*children)[1] = std::move(results[3].data);
+            program = results[results.size()-1].remainder;
+            continue;
+        }
+
+        break;
+    }
+
+    ParserResult res = match("}")(program);
+    if (!res.success)
+    {
+        delete children;
+        return failure();
+    }
+
+    ProgramData data = { TYPE_SWITCH, { .children = children } };
+    return success(res.remainder, data);
+}
+
 ParserResult return_statement(std::string program)
 {
     std::vector<ParserResult> results = seq({match("return"), expression})(program);
@@ -489,7 +745,7 @@ ParserResult return_statement(std::string program)
 
 ParserResult statement(std::string program)
 {
-    return any({return_statement, assignment, if_statement, while_loop, expression})(program);   
+    return any({return_statement, switch_statement, assignment, if_statement, while_loop, expression})(program);   
 }
 
 ParserResult block(std::string program)
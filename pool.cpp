@@ -0,0 +1,221 @@
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include "output.cpp"
+
+// Work stealing pool used by the parallel builtins. Every worker owns a
+// deque: it takes its own work from the back and steals from the front of
+// the others. The thread that starts a parallel range works on it as well,
+// which keeps nested parallel calls from deadlocking.
+
+typedef void (*RangeFunc)(void *arg, int64_t begin, int64_t end);
+
+struct ParallelRange
+{
+    RangeFunc func;
+    void *arg;
+    std::atomic<int64_t> remaining;
+
+    // Of the run that started the range, which the threads working on it
+    // charge. Chunks left once it is used up are skipped.
+    MemBudget *budget;
+};
+
+struct PoolTask
+{
+    ParallelRange *range;
+    int64_t begin;
+    int64_t end;
+};
+
+struct WorkerQueue
+{
+    std::mutex lock;
+    std::deque<PoolTask> tasks;
+};
+
+struct ThreadPool
+{
+    // Queue 0 belongs to threads outside of the pool.
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<int64_t> queued;
+    bool stopping;
+};
+
+int pool_threads = 0;
+thread_local int pool_index = 0;
+
+// From async.cpp: tasks that parallel bodies spawn belong to the thread that
+// ran the chunk, and the thread waiting for a range runs its own tasks.
+void async_finish_chunk();
+bool async_step();
+
+bool pop_task(WorkerQueue &queue, PoolTask &task, bool back)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tasks.empty())
+        return false;
+
+    if (back)
+    {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+    }
+    else
+    {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+    }
+
+    return true;
+}
+
+// Taken tasks stop counting as queued right away, so idle workers only wake
+// for work that is still there.
+bool find_task(ThreadPool &pool, int index, PoolTask &task)
+{
+    bool found = pop_task(*pool.queues[index], task, true);
+
+    int count = pool.queues.size();
+    for (int i = 1; !found && i < count; i++)
+    {
+        found = pop_task(*pool.queues[(index + i) % count], task, false);
+    }
+
+    if (found)
+        pool.queued--;
+
+    return found;
+}
+
+void run_task(ThreadPool &pool, PoolTask &task)
+{
+    {
+        MemBudgetScope budget(task.range->budget);
+        if (!mem_exceeded(task.range->budget))
+            task.range->func(task.range->arg, task.begin, task.end);
+
+        async_finish_chunk();
+    }
+
+    // Before the range can be seen as done, see output.cpp.
+    output_flush();
+    task.range->remaining--;
+}
+
+void pool_worker(ThreadPool *pool, int index)
+{
+    pool_index = index;
+    MemScope scope(MEM_OBJECTS);
+
+    while (true)
+    {
+        PoolTask task;
+        if (find_task(*pool, index, task))
+        {
+            run_task(*pool, task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(pool->lock);
+        pool->wake.wait(guard, [&] { return pool->stopping || pool->queued > 0; });
+
+        if (pool->stopping)
+            return;
+    }
+}
+
+ThreadPool *get_pool()
+{
+    static ThreadPool *pool = nullptr;
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        int threads = pool_threads > 0 ? pool_threads : std::max(1u, std::thread::hardware_concurrency());
+
+        pool = new ThreadPool();
+        pool->queued = 0;
+        pool->stopping = false;
+
+        for (int i = 0; i < threads; i++)
+        {
+            pool->queues.emplace_back(new WorkerQueue());
+        }
+
+        // Threads outside the pool work as worker 0, so one thread means no
+        // pool threads at all.
+        for (int i = 1; i < threads; i++)
+        {
+            pool->threads.emplace_back(pool_worker, pool, i);
+        }
+    });
+
+    return pool;
+}
+
+// Chunk boundaries only depend on the number of elements, never on the
+// number of threads, which is what keeps reductions deterministic.
+int64_t parallel_grain(int64_t n)
+{
+    return std::max<int64_t>(1, n / 256);
+}
+
+void parallel_range(int64_t n, RangeFunc func, void *arg)
+{
+    if (n <= 0)
+        return;
+
+    ThreadPool &pool = *get_pool();
+    int64_t grain = parallel_grain(n);
+
+    output_flush();
+
+    ParallelRange range;
+    range.func = func;
+    range.arg = arg;
+    range.remaining = (n + grain - 1) / grain;
+    range.budget = mem_budget;
+
+    {
+        WorkerQueue &queue = *pool.queues[pool_index];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        for (int64_t begin = 0; begin < n; begin += grain)
+        {
+            queue.tasks.push_back({&range, begin, std::min(n, begin + grain)});
+        }
+        pool.queued += range.remaining;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.wake.notify_all();
+    }
+
+    // The range is on this stack until every chunk is done, so a run that
+    // goes over its budget is only left once it is.
+    {
+        MemNoEscape no_escape;
+        while (range.remaining > 0)
+        {
+            PoolTask task;
+            if (find_task(pool, pool_index, task))
+                run_task(pool, task);
+            else if (!async_step())
+                std::this_thread::yield();
+        }
+    }
+
+    mem_check();
+}
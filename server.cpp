@@ -0,0 +1,417 @@
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Compile server (--serve, --socket). Clients send one command per line, on
+// standard input or on a local socket:
+//
+//     load NAME SIZE              followed by SIZE bytes of source
+//     run NAME                    runs the top level of the script
+//     call NAME FUNCTION ARGS...  calls a function with number arguments
+//     unload NAME
+//
+// and get one line back for each, "ok ..." or "error NAME message". Loads
+// that have already arrived when one is read are compiled together, one
+// script per thread. Every script shares the builtins and types, and its
+// code goes into the code arena, so unloading a script hands its code
+// back. Names are shared by all connections. Script output never goes
+// where replies do: with --serve it goes to standard error, with --socket to
+// the server's standard output. Every load, run and call has a memory budget
+// of its own (--mem-limit), and one that goes over it gets an error.
+
+struct Server
+{
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<Program>> scripts;
+
+    // Threads a batch of loads is compiled on.
+    int jobs;
+};
+
+struct ServerStream
+{
+    int in;
+    int out;
+    std::string buffer;
+    size_t position;
+};
+
+struct ServerLoad
+{
+    std::string name;
+    std::string source;
+    std::shared_ptr<Program> program;
+    std::string error;
+    double ms;
+};
+
+// Reads more input; false at the end of it.
+bool server_fill(ServerStream &stream)
+{
+    if (stream.position > 0)
+    {
+        stream.buffer.erase(0, stream.position);
+        stream.position = 0;
+    }
+
+    char chunk[1 << 16];
+    while (true)
+    {
+        ssize_t n = read(stream.in, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        stream.buffer.append(chunk, n);
+        return true;
+    }
+}
+
+bool server_line(ServerStream &stream, std::string &line)
+{
+    while (true)
+    {
+        size_t end = stream.buffer.find('\n', stream.position);
+        if (end != std::string::npos)
+        {
+            line = stream.buffer.substr(stream.position, end - stream.position);
+            stream.position = end + 1;
+            return true;
+        }
+
+        if (!server_fill(stream))
+            return false;
+    }
+}
+
+bool server_bytes(ServerStream &stream, size_t size, std::string &bytes)
+{
+    while (stream.buffer.size() - stream.position < size)
+    {
+        if (!server_fill(stream))
+            return false;
+    }
+
+    bytes = stream.buffer.substr(stream.position, size);
+    stream.position += size;
+    return true;
+}
+
+// Whether a command can be read without waiting for the client, which may
+// be waiting for the replies to the ones it sent so far.
+bool server_ready(ServerStream &stream)
+{
+    if (stream.buffer.find('\n', stream.position) != std::string::npos)
+        return true;
+
+    struct pollfd p = { stream.in, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+void server_reply(ServerStream &stream, const std::string &text)
+{
+    std::string line = text + "\n";
+
+    const char *data = line.data();
+    size_t size = line.size();
+    while (size > 0)
+    {
+        ssize_t n = write(stream.out, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        data += n;
+        size -= n;
+    }
+}
+
+std::vector<std::string> server_words(const std::string &line)
+{
+    std::vector<std::string> words;
+
+    size_t i = 0;
+    while (i < line.size())
+    {
+        if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')
+        {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+        {
+            i++;
+        }
+        words.push_back(line.substr(start, i - start));
+    }
+
+    return words;
+}
+
+// Scripts of a batch are compiled in parallel already, so each one is
+// compiled on the thread that picked it up.
+void server_compile(ServerLoad &load)
+{
+    double start = now_ms();
+
+    BenchReport report;
+    bench_init(report, false);
+
+    SourceStream source;
+    source_open_memory(source, load.source.data(), load.source.size());
+
+    Program *program = new Program();
+    bool ok = compile_program(*program, source, 1, report, load.error);
+    source_close(source);
+
+    if (ok && !link_program(*program))
+    {
+        load.error = "COULD NOT LINK";
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        free_program(program);
+        return;
+    }
+
+    load.program.reset(program, free_program);
+    load.ms = now_ms() - start;
+}
+
+void server_compile_batch(Server &server, std::vector<ServerLoad> &loads)
+{
+    std::atomic<size_t> next(0);
+    auto work = [&] {
+        for (size_t i = next++; i < loads.size(); i = next++)
+        {
+            server_compile(loads[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min((size_t)server.jobs, loads.size()); i++)
+    {
+        threads.emplace_back(work);
+    }
+
+    work();
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+std::shared_ptr<Program> server_find(Server &server, const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(server.lock);
+
+    auto it = server.scripts.find(name);
+    return it == server.scripts.end() ? nullptr : it->second;
+}
+
+// A script that is unloaded while it runs on another connection is freed
+// once that run ends.
+void server_command(Server &server, ServerStream &stream, const std::vector<std::string> &words)
+{
+    const std::string &command = words[0];
+    std::string name = words.size() > 1 ? words[1] : "";
+
+    if (command == "unload" && words.size() == 2)
+    {
+        std::lock_guard<std::mutex> guard(server.lock);
+        if (server.scripts.erase(name) == 0)
+            server_reply(stream, "error " + name + " NOT LOADED");
+        else
+            server_reply(stream, "ok " + name);
+        return;
+    }
+
+    if ((command == "run" && words.size() == 2) || (command == "call" && words.size() >= 3))
+    {
+        std::shared_ptr<Program> program = server_find(server, name);
+        if (program == nullptr)
+        {
+            server_reply(stream, "error " + name + " NOT LOADED");
+            return;
+        }
+
+        MemScope scope(MEM_OBJECTS);
+        // A run over its memory budget fails on its own, and the top level
+        // only counts as run once it got through.
+        if (command == "run")
+        {
+            bool ok = run_budgeted([&] { program_run(*program); });
+            output_flush();
+
+            if (!ok)
+            {
+                server_reply(stream, "error " + name + " OUT OF MEMORY");
+                return;
+            }
+
+            program->ran = true;
+            server_reply(stream, "ok " + name);
+            return;
+        }
+
+        if (!program->ran)
+        {
+            server_reply(stream, "error " + name + " NOT RUN");
+            return;
+        }
+
+        void *code;
+        int arity;
+        if (!program_export(*program, words[2].c_str(), code, arity))
+        {
+            server_reply(stream, "error " + name + " NO FUNCTION " + words[2]);
+            return;
+        }
+
+        if (arity != (int)words.size() - 3 || arity > call_max_args)
+        {
+            server_reply(stream, "error " + name + " " + words[2] + " TAKES " + std::to_string(arity) + " ARGUMENTS");
+            return;
+        }
+
+        uint64_t args[call_max_args];
+        for (int i = 0; i < arity; i++)
+        {
+            args[i] = (uint64_t)strtoll(words[i + 3].c_str(), nullptr, 10);
+        }
+
+        uint64_t result = 0;
+        bool ok = run_budgeted([&] { result = call_function(code, arity, args); });
+        output_flush();
+
+        if (!ok)
+            server_reply(stream, "error " + name + " OUT OF MEMORY");
+        else
+            server_reply(stream, "ok " + std::to_string((int64_t)result));
+        return;
+    }
+
+    server_reply(stream, "error " + name + " BAD COMMAND " + command);
+}
+
+void server_loads(Server &server, ServerStream &stream, std::vector<ServerLoad> &loads)
+{
+    if (loads.empty())
+        return;
+
+    server_compile_batch(server, loads);
+
+    for (auto it = loads.begin(); it != loads.end(); ++it)
+    {
+        if (it->program == nullptr)
+        {
+            server_reply(stream, "error " + it->name + " " + it->error);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(server.lock);
+            server.scripts[it->name] = it->program;
+        }
+
+        char timing[32];
+        snprintf(timing, sizeof(timing), "%.3f", it->ms);
+        server_reply(stream, "ok " + it->name + " " + std::to_string(it->program->code_size) + " " + timing);
+    }
+
+    loads.clear();
+}
+
+void serve_stream(Server &server, int in, int out)
+{
+    ServerStream stream = { in, out, "", 0 };
+    std::vector<ServerLoad> loads;
+
+    std::string line;
+    while (true)
+    {
+        // Commands run in order, so waiting loads are compiled before
+        // anything that could use them, or before blocking on the client.
+        if (!loads.empty() && !server_ready(stream))
+            server_loads(server, stream, loads);
+
+        if (!server_line(stream, line))
+            break;
+
+        std::vector<std::string> words = server_words(line);
+        if (words.empty())
+            continue;
+
+        if (words[0] == "load" && words.size() == 3)
+        {
+            ServerLoad load = { words[1] };
+            if (!server_bytes(stream, strtoull(words[2].c_str(), nullptr, 10), load.source))
+                break;
+
+            loads.push_back(std::move(load));
+            continue;
+        }
+
+        server_loads(server, stream, loads);
+        server_command(server, stream, words);
+    }
+
+    server_loads(server, stream, loads);
+    output_flush();
+}
+
+// Every connection is served on its own thread.
+bool serve_socket(Server &server, const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    while (true)
+    {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        std::thread([&server, client] {
+            serve_stream(server, client, client);
+            close(client);
+        }).detach();
+    }
+
+    close(fd);
+    return true;
+}
@@ -0,0 +1,234 @@
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Streams top-level statements out of a memory mapped source file. The
+// parser only ever sees a window of text starting at the next statement,
+// and pages that have been parsed are handed back to the kernel, so memory
+// use follows the largest statement instead of the size of the file.
+
+const size_t source_initial_window = 1024;
+
+// Windows are cut after a newline outside of any brackets or strings, so a
+// function body, argument list or string literal is never split and cannot
+// be misread as something shorter. A statement that ends close to the cut might still continue past
+// it (a longer number, an `else`, another operand), so it is only accepted
+// once this much text follows it, or the window reaches the end of the file.
+const size_t source_lookahead = 256;
+
+struct SourceStream
+{
+    const char *data;
+    size_t size;
+    size_t position;
+    size_t released;
+    bool mapped;
+};
+
+void source_skip_whitespace(SourceStream &src)
+{
+    while (src.position < src.size && is_whitespace(src.data[src.position]))
+    {
+        src.position++;
+    }
+}
+
+// Falls back to reading the whole input when it cannot be mapped (pipes).
+bool source_read(SourceStream &src, int fd)
+{
+    size_t capacity = 1 << 16;
+    char *buffer = (char *)malloc(capacity);
+    size_t size = 0;
+
+    while (true)
+    {
+        if (size == capacity)
+        {
+            capacity *= 2;
+            buffer = (char *)realloc(buffer, capacity);
+        }
+
+        ssize_t n = read(fd, buffer + size, capacity - size);
+        if (n < 0)
+        {
+            free(buffer);
+            return false;
+        }
+
+        if (n == 0)
+            break;
+
+        size += n;
+    }
+
+    src.data = buffer;
+    src.size = size;
+    src.mapped = false;
+    return true;
+}
+
+bool source_open(SourceStream &src, const char *path)
+{
+    src = {};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ok = source_read(src, fd);
+        }
+        else
+        {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            src.data = (const char *)data;
+            src.size = st.st_size;
+            src.mapped = true;
+        }
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+        ok = source_read(src, fd);
+    }
+
+    close(fd);
+
+    if (ok)
+        source_skip_whitespace(src);
+
+    return ok;
+}
+
+// Source that is already in memory, such as a script handed over by an
+// embedder. The text is copied, so the caller's buffer can go right away.
+void source_open_memory(SourceStream &src, const char *text, size_t size)
+{
+    src = {};
+
+    char *buffer = (char *)malloc(size + 1);
+    memcpy(buffer, text, size);
+    buffer[size] = 0;
+
+    src.data = buffer;
+    src.size = size;
+    src.mapped = false;
+
+    source_skip_whitespace(src);
+}
+
+void source_close(SourceStream &src)
+{
+    if (src.mapped)
+        munmap((void *)src.data, src.size);
+    else
+        free((void *)src.data);
+
+    src = {};
+}
+
+bool source_done(SourceStream &src)
+{
+    return src.position >= src.size;
+}
+
+// Drops the pages that lie completely before the parse position.
+void source_release(SourceStream &src)
+{
+    if (!src.mapped)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t end = src.position & ~(page - 1);
+
+    if (end > src.released)
+    {
+        madvise((void *)(src.data + src.released), end - src.released, MADV_DONTNEED);
+        src.released = end;
+    }
+}
+
+// Returns the end of the longest prefix of the next `window` bytes that
+// ends in a newline outside of brackets and string literals, or 0 when
+// there is none.
+size_t source_cut(SourceStream &src, size_t window)
+{
+    size_t end = std::min(src.size, src.position + window);
+    size_t cut = 0;
+    int depth = 0;
+    bool in_string = false;
+
+    for (size_t i = src.position; i < end; i++)
+    {
+        char c = src.data[i];
+        if (in_string)
+        {
+            if (c == '\\')
+                i++;
+            else if (c == '"')
+                in_string = false;
+        }
+        else if (c == '"')
+            in_string = true;
+        else if (c == '(' || c == '[' || c == '{')
+            depth++;
+        else if ((c == ')' || c == ']' || c == '}') && depth > 0)
+            depth--;
+        else if (c == '\n' && depth == 0)
+            cut = i + 1;
+    }
+
+    return cut;
+}
+
+ParserResult source_statement(SourceStream &src)
+{
+    MemScope scope(MEM_PARSER);
+    size_t window = source_initial_window;
+
+    while (true)
+    {
+        bool at_end = src.position + window >= src.size;
+        size_t end = at_end ? src.size : source_cut(src, window);
+
+        if (end == 0)
+        {
+            window *= 2;
+            continue;
+        }
+
+        size_t available = end - src.position;
+        ParserResult res = statement(std::string(src.data + src.position, available));
+
+        if (at_end || (res.success && res.remainder.size() > source_lookahead))
+        {
+            if (res.success)
+            {
+                src.position += available - res.remainder.size();
+                res.remainder.clear();
+                source_release(src);
+            }
+
+            return res;
+        }
+
+        window *= 2;
+    }
+}
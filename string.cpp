@@ -0,0 +1,181 @@
+#include <algorithm>
+
+#include <string.h>
+
+// Strings. Up to 7 bytes are kept in the value itself: the top three bits
+// are 011 (NUM_BIT plus STR_BIT), bits 56 to 58 hold the length and the
+// bytes sit in the low 7 bytes, first byte lowest, with the unused ones
+// zero. Longer strings are String objects. Every string that fits inline
+// is stored inline, so two strings with the same text and a different
+// representation never exist and small strings compare by their bits.
+
+const int64_t small_string_max = 7;
+
+struct String : public Obj
+{
+    int64_t length;
+    uint64_t hash;
+
+    // Followed by a terminating zero.
+    char chars[];
+};
+
+inline bool isHeapString(uint64_t value)
+{
+    return isObj(value) && isObjType(value, string_type_number);
+}
+
+inline bool isString(uint64_t value)
+{
+    return isSmallString(value) || isHeapString(value);
+}
+
+inline int64_t small_string_length(uint64_t value)
+{
+    return (value >> 56) & 7;
+}
+
+// FNV-1a.
+uint64_t string_hash(const char *chars, int64_t length)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int64_t i = 0; i < length; i++)
+    {
+        h = (h ^ (uint8_t)chars[i]) * 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+uint64_t make_string(const char *chars, int64_t length)
+{
+    if (length <= small_string_max)
+    {
+        uint64_t bits = 0;
+        memcpy(&bits, chars, length);
+        return bits | ((uint64_t)length << 56) | STR_BIT | NUM_BIT;
+    }
+
+    String *s = (String *)operator new(sizeof(String) + length + 1);
+    setup_object(s, string_type);
+
+    s->length = length;
+    s->hash = string_hash(chars, length);
+    memcpy(s->chars, chars, length);
+    s->chars[length] = 0;
+
+    return objToValue(s);
+}
+
+// Text of a string value; the bytes of a small string are copied to
+// buffer, which needs room for 8. Numbers are written out in decimal and
+// anything else has no text.
+const char *string_text(uint64_t value, char *buffer, int64_t *length)
+{
+    if (isSmallString(value))
+    {
+        *length = small_string_length(value);
+        memcpy(buffer, &value, 8);
+        buffer[*length] = 0;
+        return buffer;
+    }
+
+    if (isHeapString(value))
+    {
+        String *s = (String *)valueToObj(value);
+        *length = s->length;
+        return s->chars;
+    }
+
+    if (!isObj(value))
+    {
+        *length = snprintf(buffer, 24, "%lli", (long long)valueToNum(value));
+        return buffer;
+    }
+
+    *length = 0;
+    return "";
+}
+
+// Tagged string value, for natives that take or return strings.
+struct Str
+{
+    uint64_t value;
+};
+
+// Either operand may be a number, which is added as its decimal text.
+Str string_concat(Str a, Str b)
+{
+    char buffer_a[24], buffer_b[24];
+    int64_t length_a, length_b;
+    const char *chars_a = string_text(a.value, buffer_a, &length_a);
+    const char *chars_b = string_text(b.value, buffer_b, &length_b);
+
+    int64_t length = length_a + length_b;
+    if (length <= small_string_max)
+    {
+        char chars[small_string_max];
+        memcpy(chars, chars_a, length_a);
+        memcpy(chars + length_a, chars_b, length_b);
+        return {make_string(chars, length)};
+    }
+
+    String *s = (String *)operator new(sizeof(String) + length + 1);
+    setup_object(s, string_type);
+
+    s->length = length;
+    memcpy(s->chars, chars_a, length_a);
+    memcpy(s->chars + length_a, chars_b, length_b);
+    s->chars[length] = 0;
+    s->hash = string_hash(s->chars, length);
+
+    return {objToValue(s)};
+}
+
+// + whose operands had no certain type when it was compiled.
+uint64_t value_add(uint64_t a, uint64_t b)
+{
+    if (isString(a) || isString(b))
+        return string_concat({a}, {b}).value;
+    return a + b;
+}
+
+int64_t string_length(Str s)
+{
+    if (isSmallString(s.value))
+        return small_string_length(s.value);
+
+    if (isHeapString(s.value))
+        return ((String *)valueToObj(s.value))->length;
+
+    return 0;
+}
+
+// Bytes start to end, both clamped to the string.
+Str string_slice(Str s, int64_t start, int64_t end)
+{
+    char buffer[24];
+    int64_t length;
+    const char *chars = string_text(s.value, buffer, &length);
+
+    start = std::max((int64_t)0, std::min(start, length));
+    end = std::max(start, std::min(end, length));
+
+    return {make_string(chars + start, end - start)};
+}
+
+// Equal bits are equal strings; otherwise only two heap strings can still
+// have the same text.
+bool string_equal(Str a, Str b)
+{
+    if (a.value == b.value)
+        return true;
+
+    if (!isHeapString(a.value) || !isHeapString(b.value))
+        return false;
+
+    String *x = (String *)valueToObj(a.value);
+    String *y = (String *)valueToObj(b.value);
+
+    return x->length == y->length && x->hash == y->hash && memcmp(x->chars, y->chars, x->length) == 0;
+}
@@ -0,0 +1,138 @@
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+// Every identifier is interned once by the parser; from then on the compiler
+// only deals with dense integer ids and never hashes a name again.
+
+struct SymbolTable
+{
+    std::mutex lock;
+    std::unordered_map<std::string, int> ids;
+    std::deque<std::string> names;
+};
+
+SymbolTable symbols;
+
+int intern(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(symbols.lock);
+
+    auto it = symbols.ids.find(name);
+    if (it != symbols.ids.end())
+        return it->second;
+
+    int id = symbols.names.size();
+    symbols.names.push_back(name);
+    symbols.ids[name] = id;
+
+    return id;
+}
+
+const char *symbol_name(int symbol)
+{
+    std::lock_guard<std::mutex> guard(symbols.lock);
+    return symbols.names[symbol].c_str();
+}
+
+// Id of a name that was interned before, or -1.
+int find_symbol(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(symbols.lock);
+
+    auto it = symbols.ids.find(name);
+    return it != symbols.ids.end() ? it->second : -1;
+}
+
+// Table keyed by symbol id. The index is a plain array, so a lookup is one
+// bounds check and two loads; entries stay in insertion order. Ids keep
+// growing with every program a process compiles, so the array only covers
+// ids up to a few times the number of entries and the rest go to a hash
+// map; a small table never costs memory in the number of symbols.
+const int symbol_index_slack = 64;
+
+template <typename T>
+struct SymbolMap
+{
+    std::vector<int> index;
+    std::unordered_map<int, int> sparse;
+    std::vector<int> keys;
+    std::vector<T> entries;
+
+    int position(int symbol) const
+    {
+        if (symbol < (int)index.size())
+            return index[symbol];
+
+        if (sparse.empty())
+            return -1;
+
+        auto it = sparse.find(symbol);
+        return it == sparse.end() ? -1 : it->second;
+    }
+
+    T *find(int symbol)
+    {
+        int i = position(symbol);
+        return i < 0 ? nullptr : &entries[i];
+    }
+
+    // Returns the entry for symbol, adding value first if it is missing.
+    T &insert(int symbol, const T &value)
+    {
+        int i = position(symbol);
+        if (i >= 0)
+            return entries[i];
+
+        i = entries.size();
+        keys.push_back(symbol);
+        entries.push_back(value);
+
+        if (symbol < (int)index.size())
+        {
+            index[symbol] = i;
+        }
+        else if (symbol < 4 * (int)entries.size() + symbol_index_slack)
+        {
+            grow_index(symbol + 1);
+            index[symbol] = i;
+        }
+        else
+        {
+            sparse[symbol] = i;
+        }
+
+        return entries[i];
+    }
+
+    // Ids moved into the array's range leave the hash map.
+    void grow_index(int size)
+    {
+        index.resize(size, -1);
+
+        for (auto it = sparse.begin(); it != sparse.end();)
+        {
+            if (it->first < size)
+            {
+                index[it->first] = it->second;
+                it = sparse.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    void set(int symbol, const T &value)
+    {
+        insert(symbol, value) = value;
+    }
+
+    int size() const
+    {
+        return entries.size();
+    }
+};
@@ -2,45 +2,151 @@
 #include <vector>
 #include <unordered_map>
 #include <cassert>
+#include <mutex>
+#include <map>
+#include <memory>
+#include <tuple>
 
 #include <asmjit/asmjit.h>
 
+#include "memory.cpp"
+#include "pool.cpp"
+#include "symbol.cpp"
+
 using namespace asmjit;
 
 struct Type;
 struct ProgramData;
+struct CompileContext;
+struct ClosureAnalysis;
+struct FunctionAnalysis;
+
+// Where a local lives. Locals captured by closures may have to leave their
+// register, see closure.cpp.
+enum VarHome
+{
+    HOME_REGISTER,
+    HOME_STACK,
+    HOME_BOX,
+
+    // A capture received as the address of the owner's slot or box.
+    HOME_POINTER,
+
+    // A top-level variable that functions use, in its module global slot.
+    HOME_GLOBAL,
+};
 
-struct StackVar
+// Locals (parameters included) live in virtual registers and are left to
+// the register allocator. Otherwise mem is their stack slot, the cell reg
+// points to or their module global slot.
+struct LocalVar
 {
     Type *type;
-    int stack_offset;
+    X86Gp reg;
+    VarHome home;
+    X86Mem mem;
+
+    // Set for a closure that is called with its captures as arguments.
+    const FunctionAnalysis *direct;
+
+    // Non-zero for a list replaced by its count in reg and list_slots
+    // elements in mem, see escape.cpp.
+    int list_slots;
 };
 
 struct GlobalVar
 {
     Type *type;
     uint64_t value;
+
+    // Natives that never keep a function argument after returning, so
+    // closures passed to them can live in the caller's frame.
+    bool borrows;
 };
 
+// A function body waiting to be compiled. Bodies are compiled separately
+// (possibly on other threads), so code refers to a function through the
+// address stored in its slot once everything has been linked.
 struct FunctionRemainder
 {
-    CCFunc* func;
+    int slot;
     std::unique_ptr<ProgramData> data;
+    std::vector<int> params;
+
+    // Name the function was assigned to, which its body can use to call
+    // itself, or -1.
+    int self;
+
+    // Analysis of the top-level statement the function is part of.
+    std::shared_ptr<ClosureAnalysis> closures;
+    const FunctionAnalysis *analysis;
+
+    // See layout.cpp; 0 unless profiling or laying out.
+    uint64_t key;
 };
 
+const int function_slot_chunk = 1024;
+
+// Slot addresses have to stay put while slots are being handed out from
+// several compile threads, so the table grows in fixed size chunks.
+struct FunctionSlots
+{
+    std::mutex lock;
+    std::vector<uint64_t *> chunks;
+    int count;
+};
+
+int new_function_slot(FunctionSlots &slots)
+{
+    std::lock_guard<std::mutex> guard(slots.lock);
+
+    if (slots.count == (int)slots.chunks.size() * function_slot_chunk)
+        slots.chunks.push_back(new uint64_t[function_slot_chunk]());
+
+    return slots.count++;
+}
+
+uint64_t *function_slot(FunctionSlots &slots, int slot)
+{
+    std::lock_guard<std::mutex> guard(slots.lock);
+    return &slots.chunks[slot / function_slot_chunk][slot % function_slot_chunk];
+}
+
 struct JitState
 {
-    int offset;
-    std::unordered_map<std::string, StackVar> vars;
-    std::unordered_map<std::string, Imm> funcs;
-    std::unordered_map<std::string, GlobalVar> globals;
-    X86Mem mem;
-    X86Gp stack_offset;
+    SymbolMap<LocalVar> vars;
+    SymbolMap<Imm> funcs;
+    SymbolMap<GlobalVar> globals;
     std::vector<FunctionRemainder> remainders;
+    CompileContext *context;
+    int slot;
+
+    // Self-recursive calls in return position jump back to body after
+    // moving the new arguments into params.
+    int self;
+    Label entry;
+    Label body;
+    std::vector<X86Gp> params;
+
+    // Closure analysis of the current top-level statement and the part of
+    // it for this function. env holds the closure object, if there is one.
+    std::shared_ptr<ClosureAnalysis> closures;
+    const FunctionAnalysis *analysis;
+    X86Gp env;
+
+    // Lists of this function that are never allocated, see escape.cpp.
+    SymbolMap<int> scalar_lists;
+
+    // Variable the statement compiled last set to a non-negative constant,
+    // or -1, and the (list, index) pairs of the counted loops being
+    // compiled, whose l[i] needs no bounds check (see bounds.cpp).
+    int nonnegative;
+    std::vector<std::pair<int, int>> bounded;
 };
 
 #define SIGN_BIT ((uint64_t)1 << 63)
 #define NUM_BIT ((uint64_t)1 << 62)
+#define STR_BIT ((uint64_t)1 << 61)
 
 typedef union
 {
@@ -72,7 +178,18 @@ struct Type
     FunctionTable functions;
     Type *return_type;
 
-    std::unordered_map<std::string, int> function_lookup;
+    SymbolMap<int> function_lookup;
+
+    // Function types only. Natives bound through bind.cpp know their arity
+    // and signature; script functions use -1 and nullptr.
+    int arity;
+    const FuncSignature *signature;
+
+    // Object layouts only: field slots and the layouts reached by adding
+    // one more field (see object.cpp).
+    bool object;
+    SymbolMap<int> fields;
+    SymbolMap<Type *> transitions;
 };
 
 void add_function(Type *t, std::string name, bool is_method, generic_fp func, Type *function_type)
@@ -105,22 +222,49 @@ void add_function(Type *t, std::string name, bool is_method, generic_fp func, Ty
     t->functions.func[t->functions.count] = func;
     t->functions.type[t->functions.count] = function_type;
 
-    t->function_lookup[name] = t->functions.count++;
+    t->function_lookup.set(intern(name), t->functions.count++);
 }
 
+std::mutex types_lock;
 int type_count = 0;
 std::unordered_map<std::string, Type *> types;
 
+// Types by number, for code that only has an object header. Chunks never
+// move once allocated, so lookups do not take the lock.
+const int type_chunk = 1024;
+Type **type_chunks[1024];
+
+Type *type_by_number(int number)
+{
+    return type_chunks[number / type_chunk][number % type_chunk];
+}
+
 const int list_type_number = 0;
 Type *list_type;
 
+const int closure_type_number = 1;
+Type *closure_type;
+
+const int string_type_number = 2;
+Type *string_type;
+
 Type *function_type;
 
 Type *register_type(std::string name)
 {
-    Type *t = new Type({type_count++, name, {} });
+    std::lock_guard<std::mutex> guard(types_lock);
+
+    Type *t = new Type({type_count, name, {} });
     types[name] = t;
 
+    if (type_count % type_chunk == 0)
+        type_chunks[type_count / type_chunk] = new Type*[type_chunk];
+    type_chunks[type_count / type_chunk][type_count % type_chunk] = t;
+    type_count++;
+
+    t->arity = -1;
+    t->signature = nullptr;
+
     t->functions.count = 0;
     t->functions.capacity = 8;
 
@@ -145,6 +289,10 @@ struct List : public Obj
     unsigned int size;
 };
 
+// Offsets used by compiled code.
+const int32_t list_elements_offset = sizeof(Obj);
+const int32_t list_size_offset = sizeof(Obj) + 12;
+
 inline int64_t valueToNum(uint64_t value)
 {
     return (int64_t)(value);
@@ -175,6 +323,17 @@ inline bool isNum(uint64_t value)
     return (value & NUM_BIT) == 0;
 }
 
+// Small strings have NUM_BIT set too (see string.cpp).
+inline bool isObj(uint64_t value)
+{
+    return (value >> 61) == 2;
+}
+
+inline bool isSmallString(uint64_t value)
+{
+    return (value >> 61) == 3;
+}
+
 inline bool isObjType(uint64_t value, int type)
 {
     return valueToObj(value)->type == type;
@@ -183,6 +342,8 @@ inline bool isObjType(uint64_t value, int type)
 
 Obj *setup_object(Obj *o, Type *t)
 {
+    mem_check();
+
     o->type = t->type_number;
     o->funcs = &t->functions.func;
     // o->vars = new uint64_t[8];
@@ -190,7 +351,7 @@ Obj *setup_object(Obj *o, Type *t)
     return o;
 }
 
-uint64_t make_list()
+List *make_list()
 {
     List *l = (List *)setup_object(new List(), list_type);
     
@@ -198,14 +359,15 @@ uint64_t make_list()
     l->size = 0;
     l->elements = new uint64_t[l->capacity];
 
-    return objToValue(l);
+    return l;
 }
 
-uint64_t list_add_element(uint64_t list, uint64_t elm)
+List *list_add_element(List *l, uint64_t elm)
 {
-    List *l = (List *)valueToObj(list);
     if (l->size >= l->capacity)
     {
+        mem_check();
+
         l->capacity = l->capacity * 2;
         uint64_t *elems = new uint64_t[l->capacity];
 
@@ -219,57 +381,377 @@ uint64_t list_add_element(uint64_t list, uint64_t elm)
     }
 
     l->elements[l->size++] = elm;
-    return list;
+    return l;
 }
 
-uint64_t list_count(uint64_t list)
+int64_t list_count(List *l)
 {
-    List *l = (List *)valueToObj(list);
     return l->size;
 }
 
+// Closures that have captures are objects. Compiled code creates them either
+// here or in the frame of the creating function, and passes the closure as
+// a hidden first argument to its code.
+struct Closure : public Obj
+{
+    generic_fp code;
+    int64_t count;
+    uint64_t captures[];
+};
+
+// Offsets used by compiled code.
+const int32_t closure_code_offset = sizeof(Obj);
+const int32_t closure_count_offset = sizeof(Obj) + 8;
+const int32_t closure_captures_offset = sizeof(Obj) + 16;
+
+Closure *make_closure(generic_fp code, int64_t count)
+{
+    Closure *c = (Closure *)operator new(sizeof(Closure) + count * sizeof(uint64_t));
+    setup_object(c, closure_type);
+
+    c->code = code;
+    c->count = count;
+
+    return c;
+}
+
+// Heap cell of a captured variable that can outlive its function.
+uint64_t *make_box()
+{
+    mem_check();
+    return new uint64_t(0);
+}
+
+inline bool isClosure(uint64_t value)
+{
+    return isObj(value) && isObjType(value, closure_type_number);
+}
+
+// Calls a script function value, plain or closure, from native code.
+uint64_t call_value(uint64_t fn)
+{
+    if (isClosure(fn))
+        return ((func1)((Closure *)valueToObj(fn))->code)(fn);
+
+    return valueToFunc(fn)();
+}
+
+uint64_t call_value(uint64_t fn, uint64_t a)
+{
+    if (isClosure(fn))
+        return ((func2)((Closure *)valueToObj(fn))->code)(fn, a);
+
+    return ((func1)valueToFunc(fn))(a);
+}
+
+uint64_t call_value(uint64_t fn, uint64_t a, uint64_t b)
+{
+    if (isClosure(fn))
+        return ((func3)((Closure *)valueToObj(fn))->code)(fn, a, b);
+
+    return ((func2)valueToFunc(fn))(a, b);
+}
+
+#include "object.cpp"
+#include "string.cpp"
+#include "map.cpp"
+#include "async.cpp"
+
 uint64_t print(uint64_t a)
 {
-    if (isNum(a))
-        printf("%lli\n", valueToNum(a));
+    if (isString(a))
+    {
+        char buffer[24];
+        int64_t length;
+        const char *chars = string_text(a, buffer, &length);
+
+        output_bytes(chars, length);
+        output_text("\n");
+    }
+    else if (!isObj(a))
+        output_int_line(valueToNum(a));
     else if (isObjType(a, list_type_number))
     {
         List *l = (List*)valueToObj(a);
 
-        printf("[\n");
+        output_text("[\n");
         for (int i = 0; i < l->size; i++)
         {
             print(l->elements[i]);
         }
-        printf("]\n");
+        output_text("]\n");
+    }
+    else if (isObjType(a, map_type->type_number))
+    {
+        Map *m = (Map *)valueToObj(a);
+        int64_t capacity = (m->group_mask + 1) * map_group_size;
+
+        output_text("{\n");
+        for (int64_t i = 0; i < capacity; i++)
+        {
+            if (m->ctrl[i] < 0)
+                continue;
+
+            print(m->slots[i].key);
+            print(m->slots[i].value);
+        }
+        output_text("}\n");
+    }
+    else if (Object *o = as_object(a))
+    {
+        Type *t = type_by_number(o->type);
+
+        output_text("{\n");
+        for (int i = 0; i < t->fields.size(); i++)
+        {
+            output_text(symbol_name(t->fields.keys[i]));
+            output_text(": ");
+            print(*object_field(o, t->fields.entries[i]));
+        }
+        output_text("}\n");
     }
 
     return 0;
 }
 
+// Elements of a list one per line, without the brackets print adds. Runs
+// of numbers are formatted straight into the output buffer with one space
+// check per batch.
+void write_value(uint64_t a)
+{
+    if (!isObj(a) || !isObjType(a, list_type_number))
+    {
+        print(a);
+        return;
+    }
+
+    List *l = (List *)valueToObj(a);
+    const int64_t batch_size = output_buffer_size / output_int_size;
+
+    int64_t i = 0;
+    while (i < l->size)
+    {
+        int64_t batch = std::min<int64_t>(l->size - i, batch_size);
+        char *p = output_reserve(batch * output_int_size);
+
+        for (; batch > 0; batch--, i++)
+        {
+            uint64_t e = l->elements[i];
+            if (isObj(e) || isSmallString(e))
+                break;
+
+            p = format_int(p, valueToNum(e));
+            *p++ = '\n';
+        }
+        output_commit(p);
+
+        if (batch > 0)
+            print(l->elements[i++]);
+    }
+}
+
+// mem_stats()["objects"]["peak"] and so on, one map per subsystem of
+// memory.cpp with its live and peak bytes and allocation count.
+Map *mem_stats()
+{
+    Map *stats = make_map();
+
+    for (int i = 0; i < MEM_COUNT; i++)
+    {
+        MemCounter c;
+        mem_read(c, (MemSubsystem)i);
+
+        Map *counts = make_map();
+        map_set(counts, make_string("live", 4), (uint64_t)c.live.load());
+        map_set(counts, make_string("peak", 4), (uint64_t)c.peak.load());
+        map_set(counts, make_string("allocations", 11), (uint64_t)c.allocations.load());
+
+        const char *name = mem_subsystem_names[i];
+        map_set(stats, make_string(name, strlen(name)), objToValue(counts));
+    }
+
+    return stats;
+}
+
+// Parallel builtins. fn is a script function value; it is called from
+// pool threads, so anything it allocates goes through the (thread-safe)
+// global allocator, and lists it shares with other calls must not be
+// mutated concurrently.
+
+struct ParallelMap
+{
+    List *in;
+    List *out;
+    uint64_t fn;
+};
+
+void parallel_map_range(void *arg, int64_t begin, int64_t end)
+{
+    ParallelMap *m = (ParallelMap *)arg;
+    for (int64_t i = begin; i < end; i++)
+    {
+        m->out->elements[i] = call_value(m->fn, m->in->elements[i]);
+    }
+}
+
+List *parallel_map(List *in, uint64_t fn)
+{
+    List *out = make_list();
+
+    delete[] out->elements;
+    out->capacity = in->size > 0 ? in->size : 1;
+    out->elements = new uint64_t[out->capacity]();
+    out->size = in->size;
+
+    ParallelMap m = { in, out, fn };
+    parallel_range(in->size, parallel_map_range, &m);
+
+    return out;
+}
+
+struct ParallelReduce
+{
+    List *in;
+    uint64_t fn;
+    int64_t grain;
+    uint64_t *partials;
+};
+
+void parallel_reduce_range(void *arg, int64_t begin, int64_t end)
+{
+    ParallelReduce *r = (ParallelReduce *)arg;
+    uint64_t acc = r->in->elements[begin];
+    for (int64_t i = begin + 1; i < end; i++)
+    {
+        acc = call_value(r->fn, acc, r->in->elements[i]);
+    }
+
+    r->partials[begin / r->grain] = acc;
+}
+
+// Every chunk is folded on its own and the partial results are then folded
+// into init left to right, so fn has to be associative.
+uint64_t parallel_reduce(List *in, uint64_t fn, uint64_t init)
+{
+    int64_t n = in->size;
+    if (n == 0)
+        return init;
+
+    int64_t grain = parallel_grain(n);
+    int64_t chunks = (n + grain - 1) / grain;
+
+    ParallelReduce r = { in, fn, grain, new uint64_t[chunks]() };
+    parallel_range(n, parallel_reduce_range, &r);
+
+    uint64_t acc = init;
+    for (int64_t i = 0; i < chunks; i++)
+    {
+        acc = call_value(r.fn, acc, r.partials[i]);
+    }
+
+    delete[] r.partials;
+    return acc;
+}
+
+void parallel_for_range(void *arg, int64_t begin, int64_t end)
+{
+    uint64_t fn = (uint64_t)(uintptr_t)arg;
+    for (int64_t i = begin; i < end; i++)
+    {
+        call_value(fn, i);
+    }
+}
+
+void parallel_for(int64_t n, uint64_t fn)
+{
+    parallel_range(n, parallel_for_range, (void *)(uintptr_t)fn);
+}
+
 struct JitState;
 
 
-std::unordered_map<Type *, Type *> return_types;
-Type *get_return_type(Type *t)
+std::mutex return_types_lock;
+std::map<std::tuple<Type *, int, const FuncSignature *>, Type *> return_types;
+
+// Function types are shared by every function with the same return type,
+// arity and signature. Script functions have no signature, since closures
+// and functions with captures are not called like natives, so they never
+// share a type with a native of the same arity.
+Type *get_function_type(Type *t, int arity, const FuncSignature *signature)
 {
-    if (return_types.find(t) != return_types.end())
-        return return_types[t];
+    std::lock_guard<std::mutex> guard(return_types_lock);
+
+    auto key = std::make_tuple(t, arity, signature);
+    auto it = return_types.find(key);
+    if (it != return_types.end())
+        return it->second;
 
     Type *ret = register_type("");
     ret->return_type = t;
-    return_types[t] = ret;
+    ret->arity = arity;
+    ret->signature = signature;
+    return_types[key] = ret;
     return ret;
 }
 
+Type *get_return_type(Type *t)
+{
+    return get_function_type(t, -1, nullptr);
+}
+
+#include "bind.cpp"
+
+void mark_borrowing(JitState &s, const char *name)
+{
+    s.globals.find(intern(name))->borrows = true;
+}
+
 void register_types(JitState &s)
 {
     list_type = register_type("list");
     assert(list_type->type_number == list_type_number);
 
-    add_function(list_type, "add", true, (generic_fp)list_add_element, get_return_type(list_type));
-    add_function(list_type, "count", true, (generic_fp)list_count, get_return_type(nullptr));
+    closure_type = register_type("closure");
+    assert(closure_type->type_number == closure_type_number);
+
+    string_type = register_type("string");
+    assert(string_type->type_number == string_type_number);
+
+    object_type = register_type("object");
+    object_type->object = true;
+
+    map_type = register_type("map");
+    task_type = register_type("task");
+
+    BIND_METHOD(list_type, "add", list_add_element);
+    BIND_METHOD(list_type, "count", list_count);
+
+    BIND_METHOD(string_type, "length", string_length);
+    BIND_METHOD(string_type, "slice", string_slice);
+
+    BIND_METHOD(map_type, "get", map_get);
+    BIND_METHOD(map_type, "set", map_set);
+    BIND_METHOD(map_type, "has", map_has);
+    BIND_METHOD(map_type, "remove", map_remove);
+    BIND_METHOD(map_type, "count", map_count);
+
+    BIND_FUNCTION(s, "make_list", make_list);
+    BIND_FUNCTION(s, "make_map", make_map);
+    BIND_FUNCTION(s, "print", print);
+    BIND_FUNCTION(s, "write", write_value);
+    BIND_FUNCTION(s, "mem_stats", mem_stats);
+
+    BIND_FUNCTION(s, "parallel_map", parallel_map);
+    BIND_FUNCTION(s, "parallel_reduce", parallel_reduce);
+    BIND_FUNCTION(s, "parallel_for", parallel_for);
+
+    BIND_FUNCTION(s, "spawn", spawn_task);
+    BIND_FUNCTION(s, "await", await_task);
+    BIND_FUNCTION(s, "read_file", read_file);
+    BIND_FUNCTION(s, "read_lines", read_lines);
+    BIND_FUNCTION(s, "write_file", write_file);
 
-    s.globals["make_list"] = {get_return_type(list_type), funcToValue((generic_fp)make_list)};
-    s.globals["print"] = {get_return_type(nullptr), funcToValue((generic_fp)print)};
+    mark_borrowing(s, "parallel_map");
+    mark_borrowing(s, "parallel_reduce");
+    mark_borrowing(s, "parallel_for");
 }